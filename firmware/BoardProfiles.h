@@ -0,0 +1,88 @@
+/*
+
+Board profiles, selected at build time.
+
+Each PCB version is a trait type: its pins and populated hardware are constexpr, so pin numbers fold into the code and hardware that
+isn't on the board (e.g. the channel pot on a single station board) is compiled out. The names follow the version naming in the
+repo's README (v<version>-<antenna><audio output><station select><configuration location>).
+
+Select the board by defining one of these before Radio.h is included (see firmware.ino), or with -D when building from the command
+line:
+
+  RADIO_BOARD_V1_USMX_BETA_1   v1-USMX.beta-1
+  RADIO_BOARD_V1_0_USMX        v1.0-USMX
+  RADIO_BOARD_V1_0_USSX        v1.0-USMX PCB assembled without the station pot (single station)
+
+The pins are from hardware/v1-USMX/v1-USMX.xml. v1-USMX.beta-1 uses the same pins.
+
+FastPin<pin> writes an output through the GPIO set/clear registers, which is a single store instead of digitalWrite()'s pin lookup.
+pinMode() must still be called once to route the pin to the GPIO matrix.
+
+*/
+
+#pragma once  // Included by LEDStatus.h and Radio.h
+
+#include "soc/gpio_struct.h"
+
+struct BoardV1USMX {
+  static constexpr const char *pcb_version = "v1.0-USMX";
+  static constexpr bool has_channel_pot = true;
+
+  static constexpr int pin_channel_pot = 2;
+  static constexpr int pin_volume_pot = 8;
+  static constexpr int pin_dac_sd_mode = 11;
+  static constexpr int pin_i2s_dout = 12;
+  static constexpr int pin_i2s_bclk = 13;
+  static constexpr int pin_i2s_lrc = 14;
+
+  static constexpr int pin_led_red = 4;
+  static constexpr int pin_led_green = 5;
+  static constexpr int pin_led_blue = 6;
+};
+
+struct BoardV1USMXBeta1 : BoardV1USMX {
+  static constexpr const char *pcb_version = "v1-USMX.beta-1";
+};
+
+struct BoardV1USSX : BoardV1USMX {
+  static constexpr const char *pcb_version = "v1.0-USSX";
+  static constexpr bool has_channel_pot = false;
+};
+
+// C++11 needs a definition for members that are bound to a reference (e.g. ArduinoJson's operator| default).
+constexpr const char *BoardV1USMX::pcb_version;
+constexpr bool BoardV1USMX::has_channel_pot;
+constexpr const char *BoardV1USMXBeta1::pcb_version;
+constexpr const char *BoardV1USSX::pcb_version;
+constexpr bool BoardV1USSX::has_channel_pot;
+
+#if defined(RADIO_BOARD_V1_USMX_BETA_1)
+typedef BoardV1USMXBeta1 Board;
+#elif defined(RADIO_BOARD_V1_0_USMX)
+typedef BoardV1USMX Board;
+#elif defined(RADIO_BOARD_V1_0_USSX)
+typedef BoardV1USSX Board;
+#else
+#error "No board selected. Define one of the RADIO_BOARD_* profiles in BoardProfiles.h before including Radio.h."
+#endif
+
+template<int PIN>
+struct FastPin {
+  // GPIO32 and up are in the out1_w1ts/out1_w1tc registers, none of the boards use them for outputs.
+  static_assert(PIN >= 0 && PIN < 32, "FastPin only supports GPIO0-31");
+  static constexpr uint32_t mask = 1UL << PIN;
+
+  static inline void high() {
+    GPIO.out_w1ts = mask;
+  }
+  static inline void low() {
+    GPIO.out_w1tc = mask;
+  }
+  static inline void write(bool level) {
+    if (level) {
+      high();
+    } else {
+      low();
+    }
+  }
+};
@@ -0,0 +1,345 @@
+/*
+
+Keep-alive HTTP/1.1 session to the config server.
+
+Each session owns one TCP (or TLS) connection and keeps it open between requests, so a request to the same host skips the handshake.
+The response body is read into a buffer the owner allocates once (a MemoryGuard pool), instead of a String or a stream held open by
+the caller.
+
+  - Stale connections: the server closes idle connections (gunicorn after 2 s by default), and that isn't always visible until a
+    request fails. A request that fails on a reused connection is retried once on a new one.
+  - Timing: the time to connect (0 when the connection is reused) and the time from sending the request to having the whole body are
+    recorded separately for every request. Radio sends its session's counters with each config check-in as
+    config_http=<requests>,<reused>,<stale_retries>,<failures>,<connect_ms_total>,<connect_ms_max>,<transfer_ms_total>,<transfer_ms_max>,
+    covering the requests since the last check-in the server accepted. The check-in's own request is in the next one.
+  - HTTPS: used when the URL is https:// and a CA certificate has been provisioned (remote_cfg_ca). Without one, https:// requests
+    fail rather than connecting without verifying the server. The TLS connection is kept alive like a TCP one. The core's
+    WiFiClientSecure doesn't support TLS session resumption, so a new connection is always a full handshake.
+
+Radio and ConfigWatcher each have their own session, since ConfigWatcher's long-poll runs on another task.
+
+*/
+
+#include <StreamString.h>
+#include <WiFiClientSecure.h>
+
+#define CONFIG_HTTP_HOST_SIZE 128
+#define CONFIG_HTTP_CONNECT_TIMEOUT_MS 5000
+#define CONFIG_HTTP_DEFAULT_TIMEOUT_MS 10000
+
+struct ConfigHttpStats {
+  uint32_t requests = 0;
+  uint32_t reused = 0;           // Requests sent on a kept-alive connection.
+  uint32_t stale_retries = 0;    // Requests retried because the kept-alive connection had been closed.
+  uint32_t failures = 0;
+  uint32_t last_connect_ms = 0;  // 0 if the connection was reused.
+  uint32_t last_transfer_ms = 0;
+  uint32_t connect_ms_total = 0;
+  uint32_t transfer_ms_total = 0;
+  uint32_t connect_ms_max = 0;
+  uint32_t transfer_ms_max = 0;
+};
+
+class ConfigHttpSession {
+public:
+  ConfigHttpSession();
+  void set_body_buffer(char *body_buffer, size_t body_buffer_size);
+  void set_ca_cert(const char *ca_cert);
+  void set_timeout(uint16_t timeout_ms);
+  int get(const char *url);
+  const char *body();
+  size_t body_length();
+  void close();
+  bool append_query(char *url, size_t url_size);
+  void reset_stats();
+  void print(const char *name);
+
+private:
+  WiFiClient m_client_;
+  WiFiClientSecure m_secure_client_;
+  WiFiClient *m_connected_client_ = NULL;  // The client holding the kept-alive connection, or NULL.
+  HTTPClient m_http_;
+  char *m_body_ = NULL;
+  size_t m_body_size_ = 0;
+  size_t m_body_length_ = 0;
+  const char *m_ca_cert_ = NULL;
+  uint16_t m_timeout_ms_ = CONFIG_HTTP_DEFAULT_TIMEOUT_MS;
+  char m_host_[CONFIG_HTTP_HOST_SIZE] = "";
+  uint16_t m_port_ = 0;
+  ConfigHttpStats m_stats_;
+
+  // Counters at the last check-in the server accepted, and at the last append_query(). The maxima can't be subtracted, so they are
+  // kept per report: up to the last append_query(), and since it.
+  ConfigHttpStats m_reported_;
+  ConfigHttpStats m_query_;
+  uint32_t m_query_connect_ms_max_ = 0;
+  uint32_t m_query_transfer_ms_max_ = 0;
+  uint32_t m_next_connect_ms_max_ = 0;
+  uint32_t m_next_transfer_ms_max_ = 0;
+
+  static bool parse_url_(const char *url, char *host, size_t host_size, uint16_t *port, bool *secure);
+  WiFiClient *connect_(bool secure, const char *host, uint16_t port);
+  int request_(WiFiClient *client, const char *url);
+  int read_body_();
+};
+
+ConfigHttpSession::ConfigHttpSession() {
+  m_http_.setReuse(true);
+  m_http_.useHTTP10(false);
+  m_http_.setFollowRedirects(HTTPC_FORCE_FOLLOW_REDIRECTS);
+}
+
+/**
+ * Sets the buffer response bodies are read into. Call once, before get(). Requests fail with HTTPC_ERROR_TOO_LESS_RAM until it is set.
+ *
+ * @param body_buffer Receives each response body, null terminated. Allocate it once, it is used for the life of the session.
+ * @param body_buffer_size Size of body_buffer. Larger responses fail with HTTPC_ERROR_TOO_LESS_RAM.
+ */
+void ConfigHttpSession::set_body_buffer(char *body_buffer, size_t body_buffer_size) {
+  m_body_ = body_buffer;
+  m_body_size_ = body_buffer_size;
+  m_body_length_ = 0;
+  m_body_[0] = '\0';
+}
+
+/**
+ * Sets the CA certificate (PEM) that https:// servers are verified with. The string must stay valid for the life of the session.
+ */
+void ConfigHttpSession::set_ca_cert(const char *ca_cert) {
+  m_ca_cert_ = (ca_cert != NULL && ca_cert[0] != '\0') ? ca_cert : NULL;
+  if (m_ca_cert_ != NULL) m_secure_client_.setCACert(m_ca_cert_);
+}
+
+/**
+ * Sets how long to wait for the response. HTTPClient's timeout is a uint16_t, so it is less than 65.5 s.
+ */
+void ConfigHttpSession::set_timeout(uint16_t timeout_ms) {
+  m_timeout_ms_ = timeout_ms;
+}
+
+/**
+ * Sends a GET request, reusing the open connection if it is to the same host. The body is available from body() until the next
+ * request.
+ *
+ * @return The HTTP status code, or a negative HTTPC_ERROR_* code.
+ */
+int ConfigHttpSession::get(const char *url) {
+  char host[CONFIG_HTTP_HOST_SIZE];
+  uint16_t port;
+  bool secure;
+  if (m_body_ == NULL) return HTTPC_ERROR_TOO_LESS_RAM;
+  m_body_length_ = 0;
+  m_body_[0] = '\0';
+  m_stats_.requests++;
+
+  if (!parse_url_(url, host, sizeof(host), &port, &secure) || (secure && m_ca_cert_ == NULL)) {
+    m_stats_.failures++;
+    return HTTPC_ERROR_CONNECTION_REFUSED;
+  }
+
+  WiFiClient *client = secure ? &m_secure_client_ : &m_client_;
+  bool reuse = (m_connected_client_ == client && client->connected() && strcmp(host, m_host_) == 0 && port == m_port_);
+  if (!reuse) {
+    close();
+    if (connect_(secure, host, port) == NULL) {
+      m_stats_.failures++;
+      return HTTPC_ERROR_CONNECTION_REFUSED;
+    }
+  } else {
+    m_stats_.reused++;
+    m_stats_.last_connect_ms = 0;
+  }
+
+  int code = request_(client, url);
+
+  if (code < 0 && reuse) {
+    // The server closed the kept-alive connection. Try once more on a new one.
+    m_stats_.stale_retries++;
+    close();
+    if (connect_(secure, host, port) != NULL) {
+      code = request_(client, url);
+    }
+  }
+
+  if (code < 0) {
+    m_stats_.failures++;
+    close();
+  }
+  return code;
+}
+
+/**
+ * Returns the body of the last response, null terminated.
+ */
+const char *ConfigHttpSession::body() {
+  return (m_body_ != NULL) ? m_body_ : "";
+}
+
+/**
+ * Returns the length of the body of the last response.
+ */
+size_t ConfigHttpSession::body_length() {
+  return m_body_length_;
+}
+
+/**
+ * Closes the kept-alive connection, if any. The next request opens a new one.
+ */
+void ConfigHttpSession::close() {
+  if (m_connected_client_ != NULL) {
+    m_connected_client_->stop();
+    m_connected_client_ = NULL;
+  }
+  m_host_[0] = '\0';
+}
+
+/**
+ * Appends the request counters and timings since the last reset_stats() to url.
+ *
+ * @param url A URL that already has a query string.
+ * @param url_size The size of the buffer url is in.
+ * @return true if anything was appended.
+ */
+bool ConfigHttpSession::append_query(char *url, size_t url_size) {
+  m_query_ = m_stats_;
+  if (m_next_connect_ms_max_ > m_query_connect_ms_max_) m_query_connect_ms_max_ = m_next_connect_ms_max_;
+  if (m_next_transfer_ms_max_ > m_query_transfer_ms_max_) m_query_transfer_ms_max_ = m_next_transfer_ms_max_;
+  m_next_connect_ms_max_ = 0;
+  m_next_transfer_ms_max_ = 0;
+  if (m_query_.requests == m_reported_.requests) return false;
+
+  char param[128];
+  snprintf(param, sizeof(param), "&config_http=%u,%u,%u,%u,%u,%u,%u,%u",
+           m_query_.requests - m_reported_.requests, m_query_.reused - m_reported_.reused,
+           m_query_.stale_retries - m_reported_.stale_retries, m_query_.failures - m_reported_.failures,
+           m_query_.connect_ms_total - m_reported_.connect_ms_total, m_query_connect_ms_max_,
+           m_query_.transfer_ms_total - m_reported_.transfer_ms_total, m_query_transfer_ms_max_);
+  strlcat(url, param, url_size);
+  return true;
+}
+
+/**
+ * Clears the counters and timings sent by the last append_query(). Call once the server has accepted them. Requests made since are
+ * kept for the next check-in, and print() keeps showing the totals since boot.
+ */
+void ConfigHttpSession::reset_stats() {
+  m_reported_ = m_query_;
+  m_query_connect_ms_max_ = 0;
+  m_query_transfer_ms_max_ = 0;
+}
+
+/**
+ * Prints the request counters and timings to Serial.
+ */
+void ConfigHttpSession::print(const char *name) {
+  uint32_t transfers = m_stats_.requests - m_stats_.failures;
+  uint32_t connects = m_stats_.requests - m_stats_.reused + m_stats_.stale_retries;
+  Serial.printf("%s: requests=%u reused=%u stale_retries=%u failures=%u connect_ms_last=%u connect_ms_avg=%u connect_ms_max=%u transfer_ms_last=%u transfer_ms_avg=%u transfer_ms_max=%u\n",
+                name, m_stats_.requests, m_stats_.reused, m_stats_.stale_retries, m_stats_.failures,
+                m_stats_.last_connect_ms, (connects > 0) ? m_stats_.connect_ms_total / connects : 0, m_stats_.connect_ms_max,
+                m_stats_.last_transfer_ms, (transfers > 0) ? m_stats_.transfer_ms_total / transfers : 0, m_stats_.transfer_ms_max);
+}
+
+bool ConfigHttpSession::parse_url_(const char *url, char *host, size_t host_size, uint16_t *port, bool *secure) {
+  // Splits scheme://host[:port]/... into its parts.
+  const char *start;
+  if (strncmp(url, "http://", 7) == 0) {
+    *secure = false;
+    *port = 80;
+    start = url + 7;
+  } else if (strncmp(url, "https://", 8) == 0) {
+    *secure = true;
+    *port = 443;
+    start = url + 8;
+  } else {
+    return false;
+  }
+
+  size_t length = strcspn(start, ":/?");
+  if (length == 0 || length >= host_size) return false;
+  memcpy(host, start, length);
+  host[length] = '\0';
+
+  if (start[length] == ':') {
+    *port = (uint16_t)atoi(start + length + 1);
+  }
+  return *port != 0;
+}
+
+WiFiClient *ConfigHttpSession::connect_(bool secure, const char *host, uint16_t port) {
+  // connect() with a timeout isn't virtual, so it's called on the concrete client.
+  unsigned long started_at = millis();
+  WiFiClient *client;
+  int connected;
+  if (secure) {
+    client = &m_secure_client_;
+    connected = m_secure_client_.connect(host, port, CONFIG_HTTP_CONNECT_TIMEOUT_MS);
+  } else {
+    client = &m_client_;
+    connected = m_client_.connect(host, port, CONFIG_HTTP_CONNECT_TIMEOUT_MS);
+  }
+  if (!connected) {
+    client->stop();
+    return NULL;
+  }
+  // HTTPClient only sets the read timeout on connections it opens itself. Seconds, rounded like HTTPClient does.
+  if (secure) {
+    m_secure_client_.setTimeout((m_timeout_ms_ + 500) / 1000);
+  } else {
+    m_client_.setTimeout((m_timeout_ms_ + 500) / 1000);
+  }
+  uint32_t elapsed = millis() - started_at;
+  m_stats_.last_connect_ms = elapsed;
+  m_stats_.connect_ms_total += elapsed;
+  if (elapsed > m_stats_.connect_ms_max) m_stats_.connect_ms_max = elapsed;
+  if (elapsed > m_next_connect_ms_max_) m_next_connect_ms_max_ = elapsed;
+
+  m_connected_client_ = client;
+  strncpy(m_host_, host, CONFIG_HTTP_HOST_SIZE - 1);
+  m_port_ = port;
+  return client;
+}
+
+int ConfigHttpSession::request_(WiFiClient *client, const char *url) {
+  // HTTPClient reuses the client's open connection, and keeps it open after end() if the response allows it.
+  unsigned long started_at = millis();
+  m_http_.setTimeout(m_timeout_ms_);
+  m_http_.begin(*client, url);
+  int code = m_http_.GET();
+  if (code > 0) {
+    int error = read_body_();
+    if (error < 0) code = error;
+  }
+  m_http_.end();
+
+  if (code < 0) return code;
+
+  uint32_t elapsed = millis() - started_at;
+  m_stats_.last_transfer_ms = elapsed;
+  m_stats_.transfer_ms_total += elapsed;
+  if (elapsed > m_stats_.transfer_ms_max) m_stats_.transfer_ms_max = elapsed;
+  if (elapsed > m_next_transfer_ms_max_) m_next_transfer_ms_max_ = elapsed;
+  return code;
+}
+
+int ConfigHttpSession::read_body_() {
+  // Returns 0, or a negative HTTPC_ERROR_* code. The whole body must be read for the connection to be reused.
+  int size = m_http_.getSize();
+  if (size < 0) {
+    // Chunked or unknown length. HTTPClient decodes it into the stream.
+    StreamString chunked;
+    if (m_http_.writeToStream(&chunked) < 0 || chunked.length() >= m_body_size_) return HTTPC_ERROR_TOO_LESS_RAM;
+    memcpy(m_body_, chunked.c_str(), chunked.length());
+    m_body_length_ = chunked.length();
+  } else {
+    if ((size_t)size >= m_body_size_) {
+      close();  // The rest of the body is still on the connection, so it can't be reused.
+      return HTTPC_ERROR_TOO_LESS_RAM;
+    }
+    WiFiClient *stream = m_http_.getStreamPtr();
+    m_body_length_ = (stream != NULL) ? stream->readBytes(m_body_, size) : 0;
+    if (m_body_length_ < (size_t)size) return HTTPC_ERROR_READ_TIMEOUT;
+  }
+  m_body_[m_body_length_] = '\0';
+  return 0;
+}
@@ -0,0 +1,243 @@
+/*
+
+Watches the config server for changes to this radio's config.
+
+A background FreeRTOS task holds a long-poll request open to <remote_cfg_url><radio_id>/config_version?known=<version>. The server
+answers as soon as the radio's config_version changes, or after CONFIG_WATCHER_TIMEOUT_S with the unchanged version. When the version
+differs from the one the radio has, the task downloads the full config itself (<config_url><query>&update_last_seen=false), so the
+loop task never blocks on the network while the radio is playing. has_config() is then true until Radio has applied the body and called
+release_config(). The task doesn't touch the body, or poll, until then. If Radio couldn't apply it (eg: it didn't parse), the downloaded
+version is taken as known anyway, so the same config isn't downloaded again and again until it changes on the server. The download doesn't carry the stream stats, they're sent
+with the next background check-in.
+
+The task only runs once a config containing a configVersion has been downloaded, so older servers are never long-polled.
+
+The task has its own ConfigHttpSession, so it never shares a connection with get_config_from_remote(). Polls are sent back to back,
+so the session's keep-alive connection is normally reused from one poll to the next. While paused (see MemoryGuard.h), the task closes
+its connection and doesn't poll.
+
+*/
+
+#define CONFIG_WATCHER_URL_SIZE 512
+#define CONFIG_WATCHER_QUERY_SIZE 256
+#define CONFIG_WATCHER_TIMEOUT_S 50                          // HTTPClient's timeout is a uint16_t in ms, so the server must answer in less than 65 s.
+#define CONFIG_WATCHER_HTTP_TIMEOUT_MS 60000
+#define CONFIG_WATCHER_IDLE_DELAY_MS 10000                   // When there is nothing to watch, WiFi is down or polling is paused.
+#define CONFIG_WATCHER_MIN_RETRY_DELAY_MS 5000
+#define CONFIG_WATCHER_MAX_RETRY_DELAY_MS 300000
+#define CONFIG_WATCHER_TASK_STACK_SIZE 8192
+#define CONFIG_WATCHER_TASK_PRIORITY 1
+#define CONFIG_WATCHER_TASK_CORE 0
+
+class ConfigWatcher {
+public:
+  ConfigWatcher();
+  void begin(char *body_buffer, size_t body_buffer_size, bool debug = false, const char *ca_cert = NULL);
+  void set_target(const String &config_url, const char *query, int32_t version);
+  bool has_config();
+  const char *config();
+  size_t config_length();
+  void release_config(bool applied = true);
+  void set_debug(bool debug);
+  void set_paused(bool paused);
+  void print();
+
+private:
+  SemaphoreHandle_t m_mutex_ = NULL;
+  TaskHandle_t m_task_ = NULL;
+  char m_url_[CONFIG_WATCHER_URL_SIZE] = "";
+  char m_query_[CONFIG_WATCHER_QUERY_SIZE] = "";
+  int32_t m_known_version_ = -1;
+  int32_t m_downloaded_version_ = -1;  // The version of the body while m_config_ready_ is set.
+  volatile bool m_config_ready_ = false;  // Set by the task, cleared by release_config(). The body belongs to Radio while set.
+  volatile bool m_debug_ = false;
+  volatile bool m_paused_ = false;
+  ConfigHttpSession m_http_;  // Only used by the task.
+
+  static void task_(void *config_watcher);
+  void run_();
+  int32_t poll_(const char *url, int32_t known_version);
+  bool download_(const char *url, const char *query);
+};
+
+ConfigWatcher::ConfigWatcher() {
+  m_http_.set_timeout(CONFIG_WATCHER_HTTP_TIMEOUT_MS);
+}
+
+/**
+ * Starts the background task. Call once WiFi is connected. Calling it again does nothing.
+ *
+ * @param body_buffer Receives the polls and the full config (MEMORY_POOL_WATCHER_BODY). Used for the life of the watcher.
+ * @param body_buffer_size Size of body_buffer, the largest config that can be downloaded.
+ * @param debug Optional. If true, the result of each poll is sent to the Serial output.
+ * @param ca_cert Optional. The CA certificate for an https:// config URL. Must stay valid for the life of the watcher.
+ */
+void ConfigWatcher::begin(char *body_buffer, size_t body_buffer_size, bool debug, const char *ca_cert) {
+  m_debug_ = debug;
+  if (m_task_ != NULL) return;
+  m_http_.set_body_buffer(body_buffer, body_buffer_size);
+  m_http_.set_ca_cert(ca_cert);
+  m_mutex_ = xSemaphoreCreateMutex();
+  xTaskCreatePinnedToCore(task_, "config_watcher", CONFIG_WATCHER_TASK_STACK_SIZE, this, CONFIG_WATCHER_TASK_PRIORITY, &m_task_, CONFIG_WATCHER_TASK_CORE);
+}
+
+/**
+ * Sets what to watch. Call after each successful config download.
+ *
+ * @param config_url The radio's config URL (remote_cfg_url + radio_id).
+ * @param query The query string the config is requested with (?pcb_version=...), without the stats.
+ * @param version The configVersion returned with the config, or -1 if the server did not return one, which pauses watching.
+ */
+void ConfigWatcher::set_target(const String &config_url, const char *query, int32_t version) {
+  if (m_mutex_ == NULL) return;
+  xSemaphoreTake(m_mutex_, portMAX_DELAY);
+  strlcpy(m_url_, config_url.c_str(), CONFIG_WATCHER_URL_SIZE);
+  strlcpy(m_query_, query, CONFIG_WATCHER_QUERY_SIZE);
+  m_known_version_ = version;
+  xSemaphoreGive(m_mutex_);
+}
+
+/**
+ * Returns true when a changed config has been downloaded and not yet released.
+ */
+bool ConfigWatcher::has_config() {
+  return m_config_ready_;
+}
+
+/**
+ * Returns the downloaded config (JSON). Only valid while has_config() is true.
+ */
+const char *ConfigWatcher::config() {
+  return m_http_.body();
+}
+
+/**
+ * Returns the length of the downloaded config.
+ */
+size_t ConfigWatcher::config_length() {
+  return m_http_.body_length();
+}
+
+/**
+ * Hands the body back to the task. Call once the downloaded config has been applied (which updates the known version with set_target()).
+ *
+ * @param applied Optional. false if the config couldn't be applied. Its version is then taken as known, so it isn't downloaded again.
+ */
+void ConfigWatcher::release_config(bool applied) {
+  if (!applied) {
+    xSemaphoreTake(m_mutex_, portMAX_DELAY);
+    m_known_version_ = m_downloaded_version_;
+    xSemaphoreGive(m_mutex_);
+  }
+  m_config_ready_ = false;
+}
+
+/**
+ * Enables or disables debug output.
+ */
+void ConfigWatcher::set_debug(bool debug) {
+  m_debug_ = debug;
+}
+
+/**
+ * Pauses or resumes polling. A poll in progress finishes first, then the connection is closed until polling resumes.
+ */
+void ConfigWatcher::set_paused(bool paused) {
+  m_paused_ = paused;
+}
+
+/**
+ * Prints the long-poll connection counters and timings to Serial.
+ */
+void ConfigWatcher::print() {
+  m_http_.print("config_watcher_http");
+}
+
+void ConfigWatcher::task_(void *config_watcher) {
+  ((ConfigWatcher *)config_watcher)->run_();
+}
+
+void ConfigWatcher::run_() {
+  char url[CONFIG_WATCHER_URL_SIZE];
+  char query[CONFIG_WATCHER_QUERY_SIZE];
+  uint32_t retry_delay_ms = CONFIG_WATCHER_MIN_RETRY_DELAY_MS;
+
+  while (true) {
+    xSemaphoreTake(m_mutex_, portMAX_DELAY);
+    int32_t known_version = m_known_version_;
+    strlcpy(url, m_url_, CONFIG_WATCHER_URL_SIZE);
+    strlcpy(query, m_query_, CONFIG_WATCHER_QUERY_SIZE);
+    xSemaphoreGive(m_mutex_);
+
+    // Radio hasn't applied the last download yet. Polling would overwrite it.
+    if (m_config_ready_) {
+      vTaskDelay(pdMS_TO_TICKS(1000));
+      continue;
+    }
+
+    if (m_paused_) {
+      m_http_.close();
+      vTaskDelay(pdMS_TO_TICKS(CONFIG_WATCHER_IDLE_DELAY_MS));
+      continue;
+    }
+
+    if (known_version < 0 || url[0] == '\0' || !WiFi.isConnected()) {
+      vTaskDelay(pdMS_TO_TICKS(CONFIG_WATCHER_IDLE_DELAY_MS));
+      continue;
+    }
+
+    int32_t version = poll_(url, known_version);
+
+    // Download the changed config here, so Radio only has to apply it.
+    if (version >= 0 && version != known_version && !download_(url, query)) {
+      version = -1;
+    }
+
+    if (version < 0) {
+      // Back off so an unreachable server isn't flooded.
+      vTaskDelay(pdMS_TO_TICKS(retry_delay_ms));
+      retry_delay_ms = min((uint32_t)CONFIG_WATCHER_MAX_RETRY_DELAY_MS, retry_delay_ms * 2);
+      continue;
+    }
+    retry_delay_ms = CONFIG_WATCHER_MIN_RETRY_DELAY_MS;
+
+    if (version != known_version) {
+      m_downloaded_version_ = version;
+      m_config_ready_ = true;
+    }
+  }
+}
+
+int32_t ConfigWatcher::poll_(const char *url, int32_t known_version) {
+  // Returns the server's config version, or -1 on error.
+  char request_url[CONFIG_WATCHER_URL_SIZE + 64];
+  snprintf(request_url, sizeof(request_url), "%s/config_version?known=%d&timeout_s=%d", url, known_version, CONFIG_WATCHER_TIMEOUT_S);
+
+  int code = m_http_.get(request_url);
+
+  int32_t version = -1;
+  if (code == HTTP_CODE_OK) {
+    StaticJsonDocument<64> doc;
+    if (!deserializeJson(doc, m_http_.body(), m_http_.body_length())) {
+      version = doc["configVersion"] | -1;
+    }
+  }
+
+  if (m_debug_) {
+    Serial.printf("Config watcher: code=%d known=%d version=%d\n", code, known_version, version);
+  }
+  return version;
+}
+
+bool ConfigWatcher::download_(const char *url, const char *query) {
+  // Downloads the full config into the session's body. update_last_seen=false, since this isn't a check-in.
+  char request_url[CONFIG_WATCHER_URL_SIZE + CONFIG_WATCHER_QUERY_SIZE + 32];
+  snprintf(request_url, sizeof(request_url), "%s%s&update_last_seen=false", url, query);
+
+  int code = m_http_.get(request_url);
+
+  if (m_debug_) {
+    Serial.printf("Config watcher: downloaded config, code=%d length=%u\n", code, m_http_.body_length());
+  }
+  return code == HTTP_CODE_OK;
+}
@@ -0,0 +1,106 @@
+/*
+
+Local fallback audio, played from flash while the stream is lost.
+
+A clip provisioned to LittleFS (FALLBACK_AUDIO_PATH) is played through the same Audio instance as the stream, so it doesn't allocate a
+second decoder or buffers. Radio starts it as soon as a reconnect attempt fails or WiFi is lost, loops it, and stops it right before
+each reconnect attempt. Playing the clip is not playing the station: Radio reports the stream as down while the clip is playing, so
+the state machine stays in Reconnecting/WiFiLost and the watchdogs keep running.
+
+There is only one decoder, so the hand-off to the stream isn't gapless: the clip stops when a reconnect attempt starts.
+
+The clip should be a low bitrate MP3 (e.g. 32 kbps mono) so it fits in the spiffs partition. See README.md for provisioning it. If
+there is no clip, nothing changes.
+
+*/
+
+#include <LittleFS.h>
+
+#define FALLBACK_AUDIO_PATH "/fallback.mp3"
+
+class FallbackAudio {
+public:
+  void begin(bool debug = false);
+  bool available();
+  bool play(Audio *audio);
+  void stop(Audio *audio);
+  bool is_playing();
+  void print();
+
+private:
+  bool m_available_ = false;
+  bool m_playing_ = false;
+  bool m_debug_ = false;
+  unsigned long m_started_at_ = 0;
+  uint32_t m_plays_ = 0;
+  uint32_t m_loops_ = 0;
+  uint32_t m_play_ms_total_ = 0;
+};
+
+/**
+ * Mounts LittleFS and checks for the clip. Call once at boot.
+ *
+ * @param debug Optional. If true, playback is sent to the Serial output.
+ */
+void FallbackAudio::begin(bool debug) {
+  m_debug_ = debug;
+  // Don't format on failure, the partition is written by the provisioning tools.
+  m_available_ = LittleFS.begin(false) && LittleFS.exists(FALLBACK_AUDIO_PATH);
+  if (m_debug_) Serial.printf("Fallback audio: available=%d\n", m_available_);
+}
+
+/**
+ * Returns true if a clip was provisioned.
+ */
+bool FallbackAudio::available() {
+  return m_available_;
+}
+
+/**
+ * Starts the clip, or restarts it if it has ended. Does nothing if it is already playing. Call on every status check while the
+ * stream is down.
+ *
+ * @return true if the clip is playing.
+ */
+bool FallbackAudio::play(Audio *audio) {
+  if (!m_available_) return false;
+  if (m_playing_ && audio->isRunning()) return true;
+
+  if (m_playing_) {
+    m_loops_++;
+  } else {
+    m_plays_++;
+    m_started_at_ = millis();
+    if (m_debug_) Serial.println("Fallback audio: playing");
+  }
+
+  m_playing_ = audio->connecttoFS(LittleFS, FALLBACK_AUDIO_PATH);
+  if (!m_playing_) m_play_ms_total_ += millis() - m_started_at_;
+  return m_playing_;
+}
+
+/**
+ * Stops the clip. Call before connecting to the stream, and whenever the radio stops playing.
+ */
+void FallbackAudio::stop(Audio *audio) {
+  if (!m_playing_) return;
+  audio->stopSong();
+  m_playing_ = false;
+  m_play_ms_total_ += millis() - m_started_at_;
+  if (m_debug_) Serial.println("Fallback audio: stopped");
+}
+
+/**
+ * Returns true while the clip is playing instead of the stream.
+ */
+bool FallbackAudio::is_playing() {
+  return m_playing_;
+}
+
+/**
+ * Prints the playback counters to Serial.
+ */
+void FallbackAudio::print() {
+  uint32_t play_ms = m_play_ms_total_ + (m_playing_ ? millis() - m_started_at_ : 0);
+  Serial.printf("fallback_audio: available=%d playing=%d plays=%u loops=%u play_ms_total=%u\n", m_available_, m_playing_, m_plays_, m_loops_, play_ms);
+}
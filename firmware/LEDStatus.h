@@ -16,10 +16,14 @@ See the public methods for documentation on how each works
 Docs on hardware timers
 https://espressif-docs.readthedocs-hosted.com/projects/arduino-esp32/en/latest/api/timer.html
 
+The LEDs are written through the GPIO set/clear registers (see FastPin in BoardProfiles.h), so the blink interrupt is a register read
+and two stores instead of a digitalRead()/digitalWrite() per LED.
+
 */
 
 
 #include "esp_system.h"
+#include "BoardProfiles.h"
 
 #define LED_STATUS_BLINKING_THRESHOLD 49
 #define LED_STATUS_UNSET -1
@@ -31,19 +35,17 @@ https://espressif-docs.readthedocs-hosted.com/projects/arduino-esp32/en/latest/a
 #define LED_STATUS_MAX_CODE 500
 
 int g_led_status_rgb_pins[3] = { 0, 0, 0 };
-bool g_led_status_rgb_is_active[3] = { false, false, false };
+uint32_t g_led_status_active_mask = 0;  // GPIO register mask of the LEDs that are lit by the current status.
 
 void led_status_timer_callback() {
-  for (int i = 0; i < 3; i++) {
-    if (g_led_status_rgb_is_active[i]) {
-      int state = digitalRead(g_led_status_rgb_pins[i]);
-      digitalWrite(g_led_status_rgb_pins[i], !state);
-    }
-  }
+  // Toggles the active LEDs.
+  uint32_t high = GPIO.out & g_led_status_active_mask;
+  GPIO.out_w1ts = g_led_status_active_mask & ~high;
+  GPIO.out_w1tc = high;
 }
 
 struct LEDStatusConfig {
-  int rgb_pins[3] = { 4, 5, 6 };
+  int rgb_pins[3] = { Board::pin_led_red, Board::pin_led_green, Board::pin_led_blue };  // GPIO0-31
   int led_on = LOW;
   int led_off = HIGH;
   int timer_number = 0;
@@ -184,11 +186,22 @@ void LEDStatus::set_status_(int status) {
 }
 
 void LEDStatus::write_rgb_(bool rgb[3]) {
+  uint32_t high = 0;
+  uint32_t low = 0;
+  uint32_t active = 0;
   for (int i = 0; i < 3; i++) {
-    g_led_status_rgb_is_active[i] = rgb[i];
+    uint32_t mask = 1UL << g_led_status_rgb_pins[i];
+    if (rgb[i]) active |= mask;
     int state = (rgb[i]) ? m_config_->led_on : m_config_->led_off;
-    digitalWrite(g_led_status_rgb_pins[i], state);
+    if (state == HIGH) {
+      high |= mask;
+    } else {
+      low |= mask;
+    }
   }
+  g_led_status_active_mask = active;
+  GPIO.out_w1ts = high;
+  GPIO.out_w1tc = low;
 }
 
 void LEDStatus::debug_output(const char *message, int state) {
@@ -0,0 +1,283 @@
+/*
+
+Long-lived buffers, reserved once at boot, and a low-memory guard for the decoder's DMA allocations.
+
+Pools: the JSON documents, the config URL (with the telemetry appended to each check-in) and the stream URL used to be allocated and
+freed on every use, interleaved with the audio library's and WiFi's allocations, which fragments the internal heap. The response bodies
+of the two config HTTP sessions (Radio's and ConfigWatcher's) were held in internal RAM (.bss). They are now all carved out of one
+arena that is allocated in init(), before WiFi and audio start, and never freed. The arena is in PSRAM when there is PSRAM, so it
+doesn't use internal (DMA capable) RAM at all. JSON documents use the pools through PooledJsonDocument, whose allocator
+hands out its pool once and never frees it.
+
+Guard: the I2S driver and the decoder need contiguous DMA capable RAM whenever a stream is (re)connected. check() samples the largest
+free DMA block once per MEMORY_GUARD_CHECK_INTERVAL_MS:
+
+  - Reserve: MEMORY_GUARD_DMA_RESERVE_SIZE of DMA capable RAM is held from boot as a standby buffer. When the largest free block falls
+    below MEMORY_GUARD_DMA_LOW_BYTES, it is freed so the next connect still finds a block, and check() returns MEMORY_GUARD_LOW so Radio
+    can drop its other standby resources (the kept-alive config connections). Once the largest block is back above
+    MEMORY_GUARD_DMA_RECOVER_BYTES, the reserve is taken again and check() returns MEMORY_GUARD_RECOVERED.
+  - Watermarks: the lowest free internal heap and the smallest largest-DMA-block are kept since the last check-in, and per
+    MEMORY_GUARD_HISTORY_WINDOW_MS window in a ring of MEMORY_GUARD_HISTORY_SIZE windows. Both are sent with the next config check-in
+    (see append_query()), so fragmentation can be compared across the fleet.
+
+*/
+
+#define MEMORY_POOL_CONFIG_JSON 0
+#define MEMORY_POOL_SERIAL_JSON 1
+#define MEMORY_POOL_CONFIG_URL 2
+#define MEMORY_POOL_STREAM_URL 3
+#define MEMORY_POOL_CONFIG_BODY 4
+#define MEMORY_POOL_WATCHER_BODY 5
+#define MEMORY_POOL_COUNT 6
+
+#define MEMORY_POOL_CONFIG_JSON_SIZE 2048
+#define MEMORY_POOL_SERIAL_JSON_SIZE 4096
+#define MEMORY_POOL_CONFIG_URL_SIZE 2048  // remote_cfg_url + radio_id, and the telemetry sent with each check-in.
+#define MEMORY_POOL_STREAM_URL_SIZE 2048
+#define MEMORY_POOL_CONFIG_BODY_SIZE 2048   // The largest config response that can be downloaded.
+#define MEMORY_POOL_WATCHER_BODY_SIZE 2048  // The full config, downloaded by ConfigWatcher when a change is reported.
+
+#define MEMORY_GUARD_CHECK_INTERVAL_MS 1000
+#define MEMORY_GUARD_DMA_LOW_BYTES 16384
+#define MEMORY_GUARD_DMA_RESERVE_SIZE 16384
+#define MEMORY_GUARD_DMA_RECOVER_BYTES (MEMORY_GUARD_DMA_LOW_BYTES + MEMORY_GUARD_DMA_RESERVE_SIZE + 8192)  // Still above the low mark once the reserve is taken again.
+#define MEMORY_GUARD_HISTORY_SIZE 12
+#define MEMORY_GUARD_HISTORY_WINDOW_MS 300000  // 5 minutes, so the ring holds the last hour.
+
+const size_t MEMORY_POOL_SIZES[MEMORY_POOL_COUNT] = { MEMORY_POOL_CONFIG_JSON_SIZE, MEMORY_POOL_SERIAL_JSON_SIZE, MEMORY_POOL_CONFIG_URL_SIZE,
+                                                     MEMORY_POOL_STREAM_URL_SIZE, MEMORY_POOL_CONFIG_BODY_SIZE, MEMORY_POOL_WATCHER_BODY_SIZE };
+
+enum MemoryGuardEvent {
+  MEMORY_GUARD_NO_CHANGE,
+  MEMORY_GUARD_LOW,        // The largest DMA block fell below the low mark. The reserve has been freed.
+  MEMORY_GUARD_RECOVERED,  // The largest DMA block is back above the recover mark.
+};
+
+struct MemoryWatermark {
+  uint32_t free_min = UINT32_MAX;         // Lowest free internal heap, in bytes.
+  uint32_t dma_largest_min = UINT32_MAX;  // Smallest largest free DMA block, in bytes.
+
+  void sample(uint32_t free_internal, uint32_t dma_largest) {
+    if (free_internal < free_min) free_min = free_internal;
+    if (dma_largest < dma_largest_min) dma_largest_min = dma_largest;
+  }
+  bool empty() {
+    return free_min == UINT32_MAX;
+  }
+};
+
+// ArduinoJson allocator that hands out a single pool. The document's memory is the pool, so nothing is allocated or freed per use.
+struct MemoryPoolAllocator {
+  char *pool;
+  size_t size;
+
+  MemoryPoolAllocator(char *pool = NULL, size_t size = 0)
+    : pool(pool), size(size) {}
+  void *allocate(size_t n) {
+    return (pool != NULL && n <= size) ? pool : NULL;
+  }
+  void deallocate(void *) {}
+  void *reallocate(void *pointer, size_t n) {
+    return (pointer == pool && n <= size) ? pool : NULL;
+  }
+};
+
+typedef BasicJsonDocument<MemoryPoolAllocator> PooledJsonDocument;
+
+class MemoryGuard {
+public:
+  bool begin(bool debug = false);
+  char *buffer(int pool);
+  size_t size(int pool);
+  MemoryPoolAllocator json_allocator(int pool);
+  MemoryGuardEvent check();
+  bool is_low();
+  bool append_query(char *url, size_t url_size);
+  void reset_stats();
+  void print();
+  void set_debug(bool debug);
+
+private:
+  char *m_arena_ = NULL;
+  size_t m_offsets_[MEMORY_POOL_COUNT];
+  bool m_arena_in_psram_ = false;
+  void *m_reserve_ = NULL;
+  bool m_low_ = false;
+  bool m_debug_ = false;
+
+  // Since the last check-in.
+  MemoryWatermark m_since_report_;
+  uint32_t m_low_events_ = 0;
+
+  // The current window, and the ring of completed windows.
+  MemoryWatermark m_window_;
+  unsigned long m_window_started_at_ = 0;
+  MemoryWatermark m_history_[MEMORY_GUARD_HISTORY_SIZE];
+  int m_history_next_ = 0;
+  int m_history_count_ = 0;
+  int m_history_unreported_ = 0;
+
+  void take_reserve_();
+};
+
+/**
+ * Allocates the pools and the DMA reserve. Call once at boot, before WiFi and audio start.
+ *
+ * @param debug Optional. If true, low memory events are sent to the Serial output.
+ * @return false if the pools couldn't be allocated.
+ */
+bool MemoryGuard::begin(bool debug) {
+  m_debug_ = debug;
+  if (m_arena_ != NULL) return true;
+
+  size_t total = 0;
+  for (int i = 0; i < MEMORY_POOL_COUNT; i++) {
+    m_offsets_[i] = total;
+    total += MEMORY_POOL_SIZES[i];
+  }
+
+  m_arena_ = (char *)heap_caps_malloc(total, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  m_arena_in_psram_ = (m_arena_ != NULL);
+  if (m_arena_ == NULL) {
+    m_arena_ = (char *)heap_caps_malloc(total, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  }
+  if (m_arena_ == NULL) return false;
+
+  for (int i = 0; i < MEMORY_POOL_COUNT; i++) {
+    m_arena_[m_offsets_[i]] = '\0';
+  }
+
+  take_reserve_();
+  m_window_started_at_ = millis();
+
+  if (m_debug_) Serial.printf("Memory: pools=%u bytes psram=%d reserve=%d\n", total, m_arena_in_psram_, m_reserve_ != NULL);
+  return true;
+}
+
+/**
+ * Returns a pool's buffer. It is only for the pool's one user, and is reused on every call, so nothing may keep a pointer into it.
+ */
+char *MemoryGuard::buffer(int pool) {
+  return m_arena_ + m_offsets_[pool];
+}
+
+/**
+ * Returns a pool's size in bytes.
+ */
+size_t MemoryGuard::size(int pool) {
+  return MEMORY_POOL_SIZES[pool];
+}
+
+/**
+ * Returns an allocator for a PooledJsonDocument that uses the pool. Construct the document with the pool's size.
+ */
+MemoryPoolAllocator MemoryGuard::json_allocator(int pool) {
+  return MemoryPoolAllocator(buffer(pool), size(pool));
+}
+
+/**
+ * Samples the heap. Call every MEMORY_GUARD_CHECK_INTERVAL_MS.
+ *
+ * @return MEMORY_GUARD_LOW or MEMORY_GUARD_RECOVERED when the state changes, otherwise MEMORY_GUARD_NO_CHANGE.
+ */
+MemoryGuardEvent MemoryGuard::check() {
+  uint32_t free_internal = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+  uint32_t dma_largest = heap_caps_get_largest_free_block(MALLOC_CAP_DMA);
+  m_since_report_.sample(free_internal, dma_largest);
+  m_window_.sample(free_internal, dma_largest);
+
+  if (millis() - m_window_started_at_ >= MEMORY_GUARD_HISTORY_WINDOW_MS) {
+    m_history_[m_history_next_] = m_window_;
+    m_history_next_ = (m_history_next_ + 1) % MEMORY_GUARD_HISTORY_SIZE;
+    m_history_count_ = min(m_history_count_ + 1, MEMORY_GUARD_HISTORY_SIZE);
+    m_history_unreported_ = min(m_history_unreported_ + 1, MEMORY_GUARD_HISTORY_SIZE);
+    m_window_ = MemoryWatermark();
+    m_window_started_at_ = millis();
+  }
+
+  if (!m_low_ && dma_largest < MEMORY_GUARD_DMA_LOW_BYTES) {
+    m_low_ = true;
+    m_low_events_++;
+    if (m_reserve_ != NULL) {
+      heap_caps_free(m_reserve_);
+      m_reserve_ = NULL;
+    }
+    if (m_debug_) Serial.printf("Memory: low, dma_largest=%u free=%u. Released the reserve.\n", dma_largest, free_internal);
+    return MEMORY_GUARD_LOW;
+  }
+
+  if (m_low_ && dma_largest >= MEMORY_GUARD_DMA_RECOVER_BYTES) {
+    m_low_ = false;
+    take_reserve_();
+    if (m_debug_) Serial.printf("Memory: recovered, dma_largest=%u free=%u reserve=%d\n", dma_largest, free_internal, m_reserve_ != NULL);
+    return MEMORY_GUARD_RECOVERED;
+  }
+
+  return MEMORY_GUARD_NO_CHANGE;
+}
+
+/**
+ * Returns true from a MEMORY_GUARD_LOW event until the MEMORY_GUARD_RECOVERED event.
+ */
+bool MemoryGuard::is_low() {
+  return m_low_;
+}
+
+/**
+ * Appends the watermarks since the last check-in to the config request's query string. The ring's completed windows that haven't been
+ * sent are appended oldest first, as the smallest largest-DMA-block in KB per window.
+ *
+ * @return true if anything was appended.
+ */
+bool MemoryGuard::append_query(char *url, size_t url_size) {
+  if (m_since_report_.empty()) return false;
+
+  char param[64];
+  snprintf(param, sizeof(param), "&heap=%u,%u,%u", m_since_report_.free_min, m_since_report_.dma_largest_min, m_low_events_);
+  strlcat(url, param, url_size);
+
+  if (m_history_unreported_ > 0) {
+    strlcat(url, "&heap_history=", url_size);
+    for (int i = m_history_unreported_; i > 0; i--) {
+      int index = (m_history_next_ - i + MEMORY_GUARD_HISTORY_SIZE) % MEMORY_GUARD_HISTORY_SIZE;
+      snprintf(param, sizeof(param), (i > 1) ? "%u," : "%u", m_history_[index].dma_largest_min / 1024);
+      strlcat(url, param, url_size);
+    }
+  }
+  return true;
+}
+
+/**
+ * Clears the watermarks since the last check-in. Call once the server has accepted them. The ring is kept for print().
+ */
+void MemoryGuard::reset_stats() {
+  m_since_report_ = MemoryWatermark();
+  m_low_events_ = 0;
+  m_history_unreported_ = 0;
+}
+
+/**
+ * Prints the pools, the reserve and the watermarks to Serial.
+ */
+void MemoryGuard::print() {
+  Serial.printf("memory: psram=%d reserve=%d low=%d low_events=%u free=%u dma_largest=%u free_min=%u dma_largest_min=%u\n",
+                m_arena_in_psram_, m_reserve_ != NULL, m_low_, m_low_events_, heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+                heap_caps_get_largest_free_block(MALLOC_CAP_DMA), m_since_report_.free_min, m_since_report_.dma_largest_min);
+  for (int i = m_history_count_; i > 0; i--) {
+    int index = (m_history_next_ - i + MEMORY_GUARD_HISTORY_SIZE) % MEMORY_GUARD_HISTORY_SIZE;
+    Serial.printf("  window -%d: free_min=%u dma_largest_min=%u\n", i, m_history_[index].free_min, m_history_[index].dma_largest_min);
+  }
+}
+
+/**
+ * Enables or disables debug output.
+ */
+void MemoryGuard::set_debug(bool debug) {
+  m_debug_ = debug;
+}
+
+void MemoryGuard::take_reserve_() {
+  if (m_reserve_ == NULL) {
+    m_reserve_ = heap_caps_malloc(MEMORY_GUARD_DMA_RESERVE_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+  }
+}
@@ -0,0 +1,284 @@
+/*
+
+Opt-in multi-room sync (sync_mode). Radios on the same LAN playing the same station align their playout.
+
+Sync is started in Radio::init(), so changes to sync_mode and sync_time_server take effect after a restart.
+
+Live streams don't carry timestamps, and the audio library doesn't expose a stream position, so sync works on the playout delay
+instead: the amount of audio in the input buffer, in milliseconds (inBufferFilled() / bitrate). Every radio connected to the same live
+stream receives the same data at (close to) the same time, so the difference between two radios' playout delays is how far apart they
+are audibly.
+
+  - Time: the clock is set by SNTP from sync_time_server (SYNC_DEFAULT_TIME_SERVER if empty), so all radios share a clock. Until the
+    clock is set, no beacons are sent and nothing is adjusted. sync_stats reports this as time_valid=0.
+  - Beacons: while playing, each radio multicasts its radio_id, a key for the station URL, the time and its playout delay once per
+    SYNC_BEACON_INTERVAL_MS. Beacons older than SYNC_PEER_TIMEOUT_MS by the shared clock are ignored.
+  - Alignment: every SYNC_ADJUST_INTERVAL_MS the target delay is the largest delay among the radios playing the station (capped so the
+    buffer can hold it). A radio behind the target stretches its buffer by pausing output, at most SYNC_MAX_STRETCH_MS at a time.
+    Radios never need to trim, since the target is the largest delay.
+  - Skew: the spread between the largest and smallest delay in the group, measured at each adjustment, is the achieved skew.
+
+sync-test-server/ in the repo root has a stand-in stream and time server, and reports the skew across radios from their beacons.
+
+*/
+
+#include <WiFiUdp.h>
+#include <sys/time.h>
+
+#define SYNC_MULTICAST_IP IPAddress(239, 255, 73, 73)
+#define SYNC_PORT 7373
+#define SYNC_MAX_PEERS 8
+#define SYNC_RADIO_ID_SIZE 48
+#define SYNC_BEACON_INTERVAL_MS 1000
+#define SYNC_ADJUST_INTERVAL_MS 5000
+#define SYNC_PEER_TIMEOUT_MS 3000
+#define SYNC_TOLERANCE_MS 60           // About one status check, the resolution of a stretch.
+#define SYNC_MAX_STRETCH_MS 500
+#define SYNC_BUFFER_HEADROOM_PERCENT 80  // The target delay is capped to this much of the input buffer.
+#define SYNC_MIN_VALID_EPOCH_S 1600000000
+#define SYNC_DEFAULT_TIME_SERVER "pool.ntp.org"  // Routers seldom serve NTP, so the gateway isn't a safe default.
+#define SYNC_TIME_SERVER_SIZE 64
+
+struct SyncPeer {
+  char radio_id[SYNC_RADIO_ID_SIZE] = "";
+  uint32_t station_key = 0;
+  int64_t sent_at_ms = 0;
+  int32_t delay_ms = 0;
+};
+
+class PlaybackSync {
+public:
+  void begin(const String &radio_id, const String &time_server, bool debug = false);
+  void loop(Audio *audio);
+  void on_playing(Audio *audio, const String &station_url);
+  void on_stopped(Audio *audio);
+  bool is_stretching();
+  void print();
+
+private:
+  WiFiUDP m_udp_;
+  bool m_started_ = false;
+  bool m_debug_ = false;
+  char m_radio_id_[SYNC_RADIO_ID_SIZE] = "";
+  char m_time_server_[SYNC_TIME_SERVER_SIZE] = "";  // configTime() keeps the pointer.
+  uint32_t m_station_key_ = 0;
+  SyncPeer m_peers_[SYNC_MAX_PEERS];
+
+  bool m_stretching_ = false;
+  unsigned long m_stretch_until_ = 0;
+  unsigned long m_next_beacon_ = 0;
+  unsigned long m_next_adjust_ = 0;
+
+  int32_t m_delay_ms_ = -1;
+  int32_t m_target_ms_ = -1;
+  int32_t m_skew_ms_ = -1;
+  int32_t m_max_skew_ms_ = 0;
+  int m_peer_count_ = 0;
+  uint32_t m_stretches_ = 0;
+  uint32_t m_stretch_ms_total_ = 0;
+
+  static int64_t epoch_ms_();
+  static uint32_t station_key_(const String &url);
+  int32_t playout_delay_ms_(Audio *audio);
+  int32_t capacity_ms_(Audio *audio);
+  void receive_();
+  void send_beacon_();
+  void adjust_(Audio *audio);
+  void end_stretch_(Audio *audio);
+};
+
+/**
+ * Starts SNTP and joins the multicast group. Call once WiFi is connected.
+ *
+ * @param radio_id Identifies this radio in its beacons.
+ * @param time_server Host name or IP of the SNTP server. If empty, SYNC_DEFAULT_TIME_SERVER is used.
+ * @param debug Optional. If true, adjustments are sent to the Serial output.
+ */
+void PlaybackSync::begin(const String &radio_id, const String &time_server, bool debug) {
+  m_debug_ = debug;
+  strncpy(m_radio_id_, radio_id.c_str(), SYNC_RADIO_ID_SIZE - 1);
+
+  strlcpy(m_time_server_, (time_server.length() > 0) ? time_server.c_str() : SYNC_DEFAULT_TIME_SERVER, SYNC_TIME_SERVER_SIZE);
+  configTime(0, 0, m_time_server_);
+
+  m_started_ = m_udp_.beginMulticast(SYNC_MULTICAST_IP, SYNC_PORT);
+  if (m_debug_) Serial.printf("Sync: started=%d time_server=%s\n", m_started_, m_time_server_);
+}
+
+/**
+ * Receives beacons and ends stretches on time. Call on every loop, right after audio->loop().
+ */
+void PlaybackSync::loop(Audio *audio) {
+  if (!m_started_) return;
+  receive_();
+  if (m_stretching_ && Scheduler::reached(millis(), m_stretch_until_)) {
+    end_stretch_(audio);
+  }
+}
+
+/**
+ * Sends beacons and aligns playout. Call on every status check while playing.
+ *
+ * @param station_url The URL of the station being played. Radios only align with radios playing the same URL.
+ */
+void PlaybackSync::on_playing(Audio *audio, const String &station_url) {
+  if (!m_started_) return;
+
+  uint32_t key = station_key_(station_url);
+  if (key != m_station_key_) {
+    m_station_key_ = key;
+    m_next_adjust_ = millis() + SYNC_ADJUST_INTERVAL_MS;  // Let the buffer settle after connecting.
+  }
+
+  if (m_stretching_) return;
+  m_delay_ms_ = playout_delay_ms_(audio);
+
+  if (Scheduler::reached(millis(), m_next_beacon_)) {
+    m_next_beacon_ = millis() + SYNC_BEACON_INTERVAL_MS;
+    send_beacon_();
+  }
+
+  if (Scheduler::reached(millis(), m_next_adjust_)) {
+    m_next_adjust_ = millis() + SYNC_ADJUST_INTERVAL_MS;
+    adjust_(audio);
+  }
+}
+
+/**
+ * Resumes output if it was paused for a stretch. Call when the radio stops playing.
+ */
+void PlaybackSync::on_stopped(Audio *audio) {
+  if (m_stretching_) end_stretch_(audio);
+  m_station_key_ = 0;
+  m_delay_ms_ = -1;
+}
+
+/**
+ * Returns true while output is paused to stretch the buffer. The audio library reports the stream as not running while paused.
+ */
+bool PlaybackSync::is_stretching() {
+  return m_stretching_;
+}
+
+/**
+ * Prints the sync figures to Serial.
+ */
+void PlaybackSync::print() {
+  Serial.printf("sync: started=%d time_server=%s time_valid=%d peers=%d delay_ms=%d target_ms=%d skew_ms=%d max_skew_ms=%d stretches=%u stretch_ms_total=%u\n",
+                m_started_, m_time_server_, epoch_ms_() > 0, m_peer_count_, m_delay_ms_, m_target_ms_, m_skew_ms_, m_max_skew_ms_, m_stretches_, m_stretch_ms_total_);
+}
+
+int64_t PlaybackSync::epoch_ms_() {
+  // Returns the time from the shared clock, or 0 if SNTP hasn't set it yet.
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  if (tv.tv_sec < SYNC_MIN_VALID_EPOCH_S) return 0;
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+uint32_t PlaybackSync::station_key_(const String &url) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (unsigned int i = 0; i < url.length(); i++) {
+    hash = (hash ^ (uint8_t)url[i]) * 16777619u;
+  }
+  return hash;
+}
+
+int32_t PlaybackSync::playout_delay_ms_(Audio *audio) {
+  uint32_t bitrate = audio->getBitRate();
+  if (bitrate == 0) return -1;
+  return (int32_t)(((uint64_t)audio->inBufferFilled() * 8000) / bitrate);
+}
+
+int32_t PlaybackSync::capacity_ms_(Audio *audio) {
+  uint32_t bitrate = audio->getBitRate();
+  if (bitrate == 0) return -1;
+  uint64_t size = (uint64_t)audio->inBufferFilled() + audio->inBufferFree();
+  return (int32_t)((size * 8000 * SYNC_BUFFER_HEADROOM_PERCENT) / (bitrate * 100));
+}
+
+void PlaybackSync::receive_() {
+  int size;
+  while ((size = m_udp_.parsePacket()) > 0) {
+    StaticJsonDocument<192> doc;
+    if (deserializeJson(doc, m_udp_)) continue;
+
+    const char *radio_id = doc["r"] | "";
+    if (radio_id[0] == '\0' || strcmp(radio_id, m_radio_id_) == 0) continue;
+
+    // Update the peer's slot, or take the oldest.
+    int slot = 0;
+    for (int i = 0; i < SYNC_MAX_PEERS; i++) {
+      if (strcmp(m_peers_[i].radio_id, radio_id) == 0) {
+        slot = i;
+        break;
+      }
+      if (m_peers_[i].sent_at_ms < m_peers_[slot].sent_at_ms) slot = i;
+    }
+    SyncPeer &peer = m_peers_[slot];
+    strncpy(peer.radio_id, radio_id, SYNC_RADIO_ID_SIZE - 1);
+    peer.station_key = doc["k"] | 0u;
+    peer.sent_at_ms = doc["t"] | (int64_t)0;
+    peer.delay_ms = doc["d"] | -1;
+  }
+}
+
+void PlaybackSync::send_beacon_() {
+  int64_t now = epoch_ms_();
+  if (now == 0 || m_delay_ms_ < 0) return;
+
+  char beacon[160];
+  int length = snprintf(beacon, sizeof(beacon), "{\"r\":\"%s\",\"k\":%u,\"t\":%lld,\"d\":%d}", m_radio_id_, m_station_key_, now, m_delay_ms_);
+  m_udp_.beginMulticastPacket();
+  m_udp_.write((const uint8_t *)beacon, length);
+  m_udp_.endPacket();
+}
+
+void PlaybackSync::adjust_(Audio *audio) {
+  int64_t now = epoch_ms_();
+  if (now == 0 || m_delay_ms_ < 0) return;
+
+  int32_t longest = m_delay_ms_;
+  int32_t shortest = m_delay_ms_;
+  m_peer_count_ = 0;
+  for (int i = 0; i < SYNC_MAX_PEERS; i++) {
+    SyncPeer &peer = m_peers_[i];
+    if (peer.station_key != m_station_key_ || peer.delay_ms < 0) continue;
+    int64_t age = now - peer.sent_at_ms;
+    if (age < -SYNC_PEER_TIMEOUT_MS || age > SYNC_PEER_TIMEOUT_MS) continue;
+    m_peer_count_++;
+    if (peer.delay_ms > longest) longest = peer.delay_ms;
+    if (peer.delay_ms < shortest) shortest = peer.delay_ms;
+  }
+
+  if (m_peer_count_ == 0) {
+    m_target_ms_ = -1;
+    m_skew_ms_ = -1;
+    return;
+  }
+
+  m_skew_ms_ = longest - shortest;
+  if (m_skew_ms_ > m_max_skew_ms_) m_max_skew_ms_ = m_skew_ms_;
+
+  int32_t capacity = capacity_ms_(audio);
+  m_target_ms_ = (capacity > 0 && longest > capacity) ? capacity : longest;
+
+  int32_t stretch = m_target_ms_ - m_delay_ms_;
+  if (stretch <= SYNC_TOLERANCE_MS) return;
+  if (stretch > SYNC_MAX_STRETCH_MS) stretch = SYNC_MAX_STRETCH_MS;
+
+  if (m_debug_) Serial.printf("Sync: delay_ms=%d target_ms=%d peers=%d, stretching %d ms\n", m_delay_ms_, m_target_ms_, m_peer_count_, stretch);
+
+  // Pausing output lets the buffer fill while the stream keeps arriving, which adds delay.
+  audio->pauseResume();
+  m_stretching_ = true;
+  m_stretch_until_ = millis() + stretch;
+  m_stretches_++;
+  m_stretch_ms_total_ += stretch;
+}
+
+void PlaybackSync::end_stretch_(Audio *audio) {
+  audio->pauseResume();
+  m_stretching_ = false;
+}
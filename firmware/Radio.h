@@ -1,15 +1,17 @@
+#include <new>
 #include <Preferences.h>
 #include <WiFi.h>
 #include <HTTPClient.h>
 #include <ArduinoJson.h>
 #include "Audio.h"
+#include "BoardProfiles.h"
 #include "LEDStatus.h"
+#include "Scheduler.h"
 
 /*
 
 
 TODO 
-  - Make sure the code is safe for millis rollover https://arduino.stackexchange.com/questions/12587/how-can-i-handle-the-millis-rollover
   - In the if statement for reconnecting, make sure the 2000 milli delay is appropriate for the audio library's connecting timeout
 
 
@@ -72,21 +74,29 @@ MANUAL TESTS:
 #define RADIO_STATUS_001_IDLE 1
 #define RADIO_STATUS_002_BACKGROUND_CONFIG_RETRIEVAL 2
 
-
-WiFiClient client;
-HTTPClient http;
+/* TIMERS (slots in Radio::m_scheduler) */
+#define RADIO_TIMER_STATUS_CHECK 0
+#define RADIO_TIMER_DEBUG_STATUS_UPDATE 1
+#define RADIO_TIMER_BACKGROUND_CONFIG_RETRIEVAL 2
+#define RADIO_TIMER_RECONNECT_ATTEMPT 3
+#define RADIO_TIMER_WIFI_WATCHDOG 4
+#define RADIO_TIMER_RECONNECT_WATCHDOG 5
+#define RADIO_TIMER_WIFI_RECONNECT_ATTEMPT 6
+#define RADIO_TIMER_MEMORY_CHECK 7
+
+#include "ConfigHttpSession.h"
+#include "RadioStateMachine.h"
+#include "StreamStats.h"
+#include "ConfigWatcher.h"
+#include "WiFiNetworks.h"
+#include "Recovery.h"
+#include "PlaybackSync.h"
+#include "FallbackAudio.h"
+#include "MemoryGuard.h"
 
 struct RadioConfig {
 
-  // Hardware
-  int pin_channel_pot = 2;
-  int pin_volume_pot = 8;
-  int pin_dac_sd_mode = 11;
-  int pin_i2s_dout = 12;
-  int pin_i2s_bclk = 13;
-  int pin_i2s_lrc = 14;
-  bool has_channel_pot = true;
-  String pcb_version = "";
+  // Hardware (pins, pcb_version and has_channel_pot are set at build time by the board profile, see BoardProfiles.h)
   int analog_read_resolution = 12;  // This ensures the maps used in read_channel_index and read_volume are correct.
 
   // Software
@@ -103,22 +113,26 @@ struct RadioConfig {
   int debug_status_update_interval_ms = 5000;
   int status_check_interval_ms = 50;
   int wifi_disconnect_timeout_ms = 300000;      // 5 minutes
+  int wifi_init_connect_timeout_ms = 10000;     // How long to wait for a stored network at boot before starting WiFiManager.
   int wifi_init_disconnect_timeout_ms = 900000; // 15 minutes (If it's in WiFi setup mode for 15 mins, restart. It can enter WiFi setup mode if there is a power outage and the radio boots before the router. )
-    int reconnecting_timeout_ms = 300000;       // 5 minutes
+  int reconnecting_timeout_ms = 300000;         // 5 minutes
+  int reconnect_attempt_interval_ms = 5000;     // Gives the audio library time to connect and fill the streaming buffer before trying again.
 
   // Remote Config
   bool remote_config = false;
   String remote_cfg_url = "";
+  String remote_cfg_ca_cert = "";  // PEM CA certificate for an https:// remote_cfg_url. Applied at boot.
   String radio_id = "";
   int remote_config_background_retrieval_interval = 0;
+
+  // Multi-room sync
+  bool sync_mode = false;
+  String sync_time_server = "";  // SNTP server shared by the radios. If empty, pool.ntp.org is used. Both settings apply after a restart.
 };
 
 class Radio {
-  unsigned long m_last_status_check_ = 0;
-  unsigned long m_last_remote_config_retrieved_ = 0;
-  unsigned long m_last_reconnection_attempt = 0;
-  unsigned long m_last_wifi_connected = 0;
-  unsigned long m_last_good_connection = 0;
+  // Owns every periodic check and watchdog in the radio. See the RADIO_TIMER_* slots.
+  Scheduler m_scheduler;
 
   /*
 
@@ -140,7 +154,6 @@ class Radio {
   void handle_serial_input_();
 
   // Debugging. If m_debug_mode is false, these are unused.
-  unsigned long m_last_debug_status_update_ = 0;
   uint32_t m_debug_lps_ = 0;  // Loops per second
 
   /* Status related variables */
@@ -153,11 +166,47 @@ class Radio {
   // Outputs
   int m_channel_index_output = 0;
 
-  bool m_reconnecting_to_stream = false;
+  // Playback state. Changing volume from 0 to something greater than 0 requests the stream. Changing the volume to 0 stops the stream.
+  RadioStateMachine m_state_machine;
+  RadioEvent read_event_();
+  void enter_state_(RadioState state);
+  void exit_state_(RadioState state);
+  void run_state_(RadioEvent event);
+
+  // Stream quality counters, sent with each config check-in.
+  StreamStats m_stream_stats;
+
+  // Keep-alive connection to the config server. The config is downloaded into MEMORY_POOL_CONFIG_BODY.
+  ConfigHttpSession m_config_http;
+  String m_config_ca_cert_;  // The CA the sessions were given at boot. Not changed after, since the sessions point into it.
+
+  // Long-polls the config server so config changes are applied within seconds, while playing or not.
+  ConfigWatcher m_config_watcher;
+  void apply_remote_config_change_();
+  void schedule_config_retrieval_();
+  void format_config_query_(char *query, size_t query_size);
+  bool apply_config_(const char *json, size_t length);
+  bool m_config_retrieval_due_ = false;  // Set when the background retrieval timer comes due, cleared when the download runs at Idle.
+  String *station_url_(int index);
+
+  // Stored WiFi networks, chosen by signal strength and past success when reconnecting.
+  WiFiNetworks m_wifi_networks;
+
+  // What a watchdog does when it expires. Restarting the ESP is the last resort.
+  Recovery m_recovery;
+  void recover_(RecoveryTier tier, int watchdog_timer, unsigned long watchdog_timeout_ms);
+  void rebuild_audio_();
+  void rebuild_wifi_();
+
+  // Aligns playout with other radios on the LAN playing the same station, when sync_mode is on.
+  PlaybackSync m_playback_sync;
+
+  // A clip from flash, played while the stream or WiFi is lost.
+  FallbackAudio m_fallback_audio;
 
-  // Statuses (Associated with actions)
-  bool m_playing = false;  // (this is volume > 0 and connection successful) Changing volume from 0 to something greater than 0 requests the stream. Changing the volume to 0 stops the stream.
-  bool m_stream_connect_established = false;
+  // Buffers reserved at boot, and the low-memory guard that drops standby resources before the decoder's DMA allocations fail.
+  MemoryGuard m_memory;
+  void check_memory_();
 
 public:
   Radio(RadioConfig *radio_config, WiFiManager *myWifiManager, Audio *myAudio, LEDStatusConfig *led_status_config);
@@ -194,10 +243,10 @@ Radio::Radio(RadioConfig *radio_config, WiFiManager *myWifiManager, Audio *myAud
 bool Radio::connect_to_stream_host() {
 
   set_dac_sd_mode(true);  // Turn DAC on
+  m_fallback_audio.stop(audio);
 
-  String *channels[] = { &m_radio_config->stn_1_url, &m_radio_config->stn_2_url, &m_radio_config->stn_3_url, &m_radio_config->stn_4_url };
-  char selected_channel_url[2048];
-  channels[m_channel_index_output]->toCharArray(selected_channel_url, 2048);
+  char *selected_channel_url = m_memory.buffer(MEMORY_POOL_STREAM_URL);
+  station_url_(m_channel_index_output)->toCharArray(selected_channel_url, m_memory.size(MEMORY_POOL_STREAM_URL));
 
   if (m_debug_mode) {
     Serial.print("selected_channel_url=");
@@ -207,85 +256,116 @@ bool Radio::connect_to_stream_host() {
   return audio->connecttohost(selected_channel_url);
 }
 
+String *Radio::station_url_(int index) {
+  // An index outside the configured stations (ie: -1 while a station change is pending) is an empty URL.
+  static String no_station;
+  String *channels[] = { &m_radio_config->stn_1_url, &m_radio_config->stn_2_url, &m_radio_config->stn_3_url, &m_radio_config->stn_4_url };
+  if (index < 0 || index >= m_radio_config->station_count || index >= (int)(sizeof(channels) / sizeof(channels[0]))) {
+    no_station = "";
+    return &no_station;
+  }
+  return channels[index];
+}
+
 void Radio::get_config_from_preferences() {
   // IMPORTANT the preferences library accepts keys up to 15 characters. Larger keys can be passed and no error will be thrown, but strange things may happen.
   preferences.begin("config", false);
   m_radio_config->remote_cfg_url = preferences.getString("remote_cfg_url", m_radio_config->remote_cfg_url);
+  m_radio_config->remote_cfg_ca_cert = preferences.getString("rem_cfg_ca", m_radio_config->remote_cfg_ca_cert);
   m_radio_config->remote_config = preferences.getBool("remote_config", m_radio_config->remote_config);
   m_radio_config->remote_config_background_retrieval_interval = preferences.getInt("ret_rem_cfg_int", m_radio_config->remote_config_background_retrieval_interval);
   m_radio_config->radio_id = preferences.getString("radio_id", m_radio_config->radio_id);
-  m_radio_config->has_channel_pot = preferences.getBool("has_channel_pot", m_radio_config->has_channel_pot);
-  m_radio_config->pcb_version = preferences.getString("pcb_version", m_radio_config->pcb_version);
   m_radio_config->stn_1_url = preferences.getString("stn_1_url", m_radio_config->stn_1_url);
   m_radio_config->stn_2_url = preferences.getString("stn_2_url", m_radio_config->stn_2_url);
   m_radio_config->stn_3_url = preferences.getString("stn_3_url", m_radio_config->stn_3_url);
   m_radio_config->stn_4_url = preferences.getString("stn_4_url", m_radio_config->stn_4_url);
   m_radio_config->station_count = preferences.getInt("station_count", m_radio_config->station_count);
+  m_radio_config->sync_mode = preferences.getBool("sync_mode", m_radio_config->sync_mode);
+  m_radio_config->sync_time_server = preferences.getString("sync_time_srv", m_radio_config->sync_time_server);
   preferences.end();
 }
 
 void Radio::put_config_to_preferences() {
   preferences.begin("config", false);
   preferences.putString("remote_cfg_url", m_radio_config->remote_cfg_url);
+  preferences.putString("rem_cfg_ca", m_radio_config->remote_cfg_ca_cert);
   preferences.putBool("remote_config", m_radio_config->remote_config);
   preferences.putInt("ret_rem_cfg_int", m_radio_config->remote_config_background_retrieval_interval);
   preferences.putString("radio_id", m_radio_config->radio_id);
-  preferences.putBool("has_channel_pot", m_radio_config->has_channel_pot);
-  preferences.putString("pcb_version", m_radio_config->pcb_version);
   preferences.putString("stn_1_url", m_radio_config->stn_1_url);
   preferences.putString("stn_2_url", m_radio_config->stn_2_url);
   preferences.putString("stn_3_url", m_radio_config->stn_3_url);
   preferences.putString("stn_4_url", m_radio_config->stn_4_url);
   preferences.putInt("station_count", m_radio_config->station_count);
+  preferences.putBool("sync_mode", m_radio_config->sync_mode);
+  preferences.putString("sync_time_srv", m_radio_config->sync_time_server);
   preferences.end();
 }
 
 bool Radio::get_config_from_remote() {
   // returns error: true|false
 
-  // To preventing flooding, this is set regardless of the success
-  m_last_remote_config_retrieved_ = millis();
+  // To preventing flooding, this is scheduled regardless of the success
+  schedule_config_retrieval_();
 
   if (!m_radio_config->remote_config) {
     return false;
   }
 
-  char has_channel_potentiometer[5];
-  (m_radio_config->has_channel_pot) ? strcpy(has_channel_potentiometer, "true") : strcpy(has_channel_potentiometer, "false");
-  String url = m_radio_config->remote_cfg_url
-               + m_radio_config->radio_id
-               + "?pcb_version=" + m_radio_config->pcb_version
-               + "&firmware_version=" + FIRMWARE_VERSION
-               + "&max_station_count=" + (String)m_radio_config->max_station_count
-               + "&has_channel_potentiometer=" + has_channel_potentiometer;
+  char *url = m_memory.buffer(MEMORY_POOL_CONFIG_URL);
+  size_t url_size = m_memory.size(MEMORY_POOL_CONFIG_URL);
+  int prefix_length = snprintf(url, url_size, "%s%s", m_radio_config->remote_cfg_url.c_str(), m_radio_config->radio_id.c_str());
+  format_config_query_(url + prefix_length, url_size - prefix_length);
+  m_stream_stats.append_query(url, url_size);
+  m_wifi_networks.append_query(url, url_size);
+  m_memory.append_query(url, url_size);
+  m_state_machine.append_query(url, url_size);
+  m_config_http.append_query(url, url_size);
 
   if (m_debug_mode) {
     Serial.print(F("Remote config: url="));
     Serial.println(url);
   }
 
-  http.setFollowRedirects(HTTPC_FORCE_FOLLOW_REDIRECTS);
-  http.useHTTP10(true);
-  http.begin(client, url);
-  int code = http.GET();
+  // Reuses the connection from the last download if the server kept it open.
+  int code = m_config_http.get(url);
 
   if (m_debug_mode) {
     Serial.print(F("Config HTTP Request Response Code: "));
     Serial.println(code);
+    m_config_http.print("config_http");
   }
 
-  if (code > 399) {
+  if (code < 0 || code > 399) {
     return true;
   }
 
-  DynamicJsonDocument doc(2048);
-  DeserializationError error = deserializeJson(doc, http.getStream());
+  // The server has recorded the stream stats.
+  m_stream_stats.reset();
+  m_wifi_networks.reset_stats();
+  m_memory.reset_stats();
+  m_state_machine.reset_stats();
+  m_config_http.reset_stats();
+
+  return apply_config_(m_config_http.body(), m_config_http.body_length());
+}
+
+void Radio::format_config_query_(char *query, size_t query_size) {
+  // The query string the config is requested with, without the stats.
+  const char *has_channel_potentiometer = (Board::has_channel_pot) ? "true" : "false";
+  snprintf(query, query_size, "?pcb_version=%s&firmware_version=%s&max_station_count=%d&has_channel_potentiometer=%s",
+           Board::pcb_version, FIRMWARE_VERSION, m_radio_config->max_station_count, has_channel_potentiometer);
+}
+
+bool Radio::apply_config_(const char *json, size_t length) {
+  // Applies a config downloaded from the server. returns error: true|false
+  PooledJsonDocument doc(MEMORY_POOL_CONFIG_JSON_SIZE, m_memory.json_allocator(MEMORY_POOL_CONFIG_JSON));
+  DeserializationError error = deserializeJson(doc, json, length);
   if (error) {
     if (m_debug_mode) {
       Serial.print(F("deserializeJson() failed: "));
       Serial.println(error.f_str());
     }
-    http.end();
     return true;
   }
 
@@ -297,6 +377,14 @@ bool Radio::get_config_from_remote() {
   m_radio_config->remote_config_background_retrieval_interval = doc["remote_config_background_retrieval_interval"] | m_radio_config->remote_config_background_retrieval_interval;
   put_config_to_preferences();
 
+  // The interval may have been changed by the server.
+  schedule_config_retrieval_();
+
+  // Watch for the next change. Servers that don't return configVersion aren't watched.
+  char query[CONFIG_WATCHER_QUERY_SIZE];
+  format_config_query_(query, sizeof(query));
+  m_config_watcher.set_target(m_radio_config->remote_cfg_url + m_radio_config->radio_id, query, doc["configVersion"] | -1);
+
   if (m_debug_mode) {
     Serial.println("Sucessfully retrieved config from remote server.");
   }
@@ -304,30 +392,27 @@ bool Radio::get_config_from_remote() {
   // If the stations are passed as an array, access the array like this:
   // JsonArray station_urls = doc["station_urls"].as<JsonArray>();
 
-  http.end();
-
   return false;
 }
 
 int Radio::read_channel_index() {
-  int channel_input = analogRead(m_radio_config->pin_channel_pot);
+  // Compiled out on boards without a channel pot, which always play the first station.
+  if (!Board::has_channel_pot) return 0;
+
+  int channel_input = analogRead(Board::pin_channel_pot);
   channel_input = map(channel_input, 0, 4095, 0, 11);
   return m_channels_lookup_table_[m_radio_config->station_count - 1][channel_input];
 }
 
 int Radio::read_volume() {
-  int volume_raw = analogRead(m_radio_config->pin_volume_pot);
+  int volume_raw = analogRead(Board::pin_volume_pot);
   int volume = map(volume_raw, 0, 4095, m_radio_config->volume_min, m_radio_config->volume_max);
   return volume;
 }
 
 void Radio::set_dac_sd_mode(bool enable) {
   // Sets the SD mode pin that's connected to the DAC. true turns the DAC on, false turns the dac off.
-  if (enable) {
-    digitalWrite(m_radio_config->pin_dac_sd_mode, HIGH);
-  } else {
-    digitalWrite(m_radio_config->pin_dac_sd_mode, LOW);
-  }
+  FastPin<Board::pin_dac_sd_mode>::write(enable);
 }
 
 void Radio::init() {
@@ -336,6 +421,16 @@ void Radio::init() {
 
   init_debug_mode();
 
+  m_recovery.init(m_debug_mode);
+
+  // Reserve the long-lived buffers before WiFi and audio start allocating.
+  if (!m_memory.begin(m_debug_mode)) {
+    Serial.println("Unable to allocate the memory pools, restarting.");
+    m_recovery.restart();
+    return;
+  }
+  m_config_http.set_body_buffer(m_memory.buffer(MEMORY_POOL_CONFIG_BODY), m_memory.size(MEMORY_POOL_CONFIG_BODY));
+
   m_led_status.init(m_led_status_config, m_debug_mode);
 
   get_config_from_preferences();
@@ -364,7 +459,7 @@ void Radio::init() {
 
   analogReadResolution(m_radio_config->analog_read_resolution);
 
-  pinMode(m_radio_config->pin_dac_sd_mode, OUTPUT);
+  pinMode(Board::pin_dac_sd_mode, OUTPUT);
 
   // Initialize WiFi/WiFiManager
   WiFi.mode(WIFI_STA);
@@ -374,29 +469,56 @@ void Radio::init() {
   // uint8_t mac_address[] = { 0x08, 0x71, 0x90, 0x89, 0x85, 0x87 };
   // esp_wifi_set_mac(WIFI_IF_STA, mac_address);
 
+  // Try the stored networks first. WiFiManager is only needed if none of them are in range.
+  m_wifi_networks.init(m_debug_mode);
+  if (m_wifi_networks.connect_best()) {
+    WiFi.waitForConnectResult(m_radio_config->wifi_init_connect_timeout_ms);
+  }
+
   m_wifi_manager->setDebugOutput(m_debug_mode);
   m_wifi_manager->setConfigPortalBlocking(false);
-  m_wifi_manager->autoConnect("Radio Setup");
+  if (!WiFi.isConnected()) {
+    m_wifi_manager->autoConnect("Radio Setup");
+  }
+  m_scheduler.schedule(RADIO_TIMER_WIFI_WATCHDOG, m_radio_config->wifi_init_disconnect_timeout_ms);
   while (!WiFi.isConnected()) {
     // While the WiFi manager is active, handle its loop, as well as serial input.
     m_wifi_manager->process();
     handle_serial_input_();
 
-    // If it's been more than wifi_disconnect_timeout_ms since it's been connected to wifi, restart the esp.
-    if (millis() > m_radio_config->wifi_init_disconnect_timeout_ms) {
-      ESP.restart();
-      return;
+    // If it's been more than wifi_init_disconnect_timeout_ms since WiFi setup started, scan for the stored networks once more, since
+    // the router may have come back after a power outage. Restart the esp if that was already tried or none of them are in range.
+    if (m_scheduler.is_due(RADIO_TIMER_WIFI_WATCHDOG)) {
+      if (m_recovery.escalate(RECOVERY_TIER_WIFI) == RECOVERY_TIER_RESTART || !m_wifi_networks.connect_best()) {
+        m_recovery.restart();
+        return;
+      }
+      m_scheduler.schedule(RADIO_TIMER_WIFI_WATCHDOG, m_radio_config->wifi_init_disconnect_timeout_ms);
     }
   }
 
   // WiFi is connected, clear the code, if set.
+  m_scheduler.cancel(RADIO_TIMER_WIFI_WATCHDOG);
+  m_wifi_networks.remember_connected();
+  m_recovery.on_wifi_connected();
   m_led_status.clear_status(RADIO_STATUS_450_UNABLE_TO_CONNECT_TO_WIFI_WM_ACTIVE);
 
   // Initialize Audio
-  audio->setPinout(m_radio_config->pin_i2s_bclk, m_radio_config->pin_i2s_lrc, m_radio_config->pin_i2s_dout);
+  audio->setPinout(Board::pin_i2s_bclk, Board::pin_i2s_lrc, Board::pin_i2s_dout);
   audio->setVolume(0);
 
+  m_fallback_audio.begin(m_debug_mode);
+
+  if (m_radio_config->sync_mode) {
+    m_playback_sync.begin(m_radio_config->radio_id, m_radio_config->sync_time_server, m_debug_mode);
+  }
+
   // Get config from remote server
+  m_config_ca_cert_ = m_radio_config->remote_cfg_ca_cert;
+  m_config_http.set_ca_cert(m_config_ca_cert_.c_str());
+  if (m_radio_config->remote_config) {
+    m_config_watcher.begin(m_memory.buffer(MEMORY_POOL_WATCHER_BODY), m_memory.size(MEMORY_POOL_WATCHER_BODY), m_debug_mode, m_config_ca_cert_.c_str());
+  }
   bool error = get_config_from_remote();
   if (error) {
     // Show the error, but move on since the radio should be able to use the config stored in preferences.
@@ -406,6 +528,11 @@ void Radio::init() {
   }
 
   m_led_status.set_status(RADIO_STATUS_000_BOOT_COMPLETE);
+
+  // Start the status checks on the first loop.
+  m_state_machine.init();
+  m_scheduler.schedule(RADIO_TIMER_STATUS_CHECK, 0);
+  m_scheduler.schedule(RADIO_TIMER_MEMORY_CHECK, 0);
 };
 
 void Radio::init_debug_mode() {
@@ -433,10 +560,11 @@ void Radio::print_config_to_serial() {
   Serial.println("Radio Config");
   Serial.print("remote_cfg_url=");
   Serial.println(m_radio_config->remote_cfg_url);
+  Serial.printf("remote_cfg_ca=%s\n", (m_radio_config->remote_cfg_ca_cert.length() > 0) ? "set" : "none");
   Serial.printf("remote_config=%d\n", m_radio_config->remote_config);
   Serial.print("radioID=");
   Serial.println(m_radio_config->radio_id);
-  Serial.printf("has_channel_pot=%d\n", m_radio_config->has_channel_pot);
+  Serial.printf("has_channel_pot=%d\n", Board::has_channel_pot);
   Serial.print("stn_1_url=");
   Serial.println(m_radio_config->stn_1_url);
   Serial.print("stn_2_url=");
@@ -448,19 +576,23 @@ void Radio::print_config_to_serial() {
   Serial.printf("station_count=%d\n", m_radio_config->station_count);
   Serial.printf("max_station_count=%d\n", m_radio_config->max_station_count);
   Serial.print("pcb_version=");
-  Serial.println(m_radio_config->pcb_version);
+  Serial.println(Board::pcb_version);
   Serial.print("remote_config_background_retrieval_interval=");
   Serial.println(m_radio_config->remote_config_background_retrieval_interval);
+  Serial.printf("sync_mode=%d\n", m_radio_config->sync_mode);
+  Serial.print("sync_time_server=");
+  Serial.println(m_radio_config->sync_time_server);
 }
 
 void Radio::debug_mode_loop() {
   m_debug_lps_++;
-  if (millis() - m_last_debug_status_update_ > m_radio_config->debug_status_update_interval_ms) {
+  if (m_scheduler.run_every(RADIO_TIMER_DEBUG_STATUS_UPDATE, m_radio_config->debug_status_update_interval_ms)) {
     int lps = m_debug_lps_ / (m_radio_config->debug_status_update_interval_ms / 1000);
     m_debug_lps_ = 0;
     Serial.printf("lps=%d\n", lps);
 
-    m_last_debug_status_update_ = millis();
+    m_state_machine.print_stats();
+    m_recovery.print();
 
     Serial.print("Heap: ");
     Serial.print(esp_get_free_heap_size());
@@ -479,7 +611,7 @@ void Radio::debug_mode_loop() {
 
 void Radio::handle_serial_input_() {
   while (Serial.available() > 0) {
-    DynamicJsonDocument doc(4096);
+    PooledJsonDocument doc(MEMORY_POOL_SERIAL_JSON_SIZE, m_memory.json_allocator(MEMORY_POOL_SERIAL_JSON));
     DeserializationError error = deserializeJson(doc, Serial);
     if (!error) {
 
@@ -487,19 +619,31 @@ void Radio::handle_serial_input_() {
       Serial.println("");
 
       m_radio_config->remote_cfg_url = doc["remote_cfg_url"] | m_radio_config->remote_cfg_url;
+      m_radio_config->remote_cfg_ca_cert = doc["remote_cfg_ca"] | m_radio_config->remote_cfg_ca_cert;
       m_radio_config->remote_config = doc["remote_config"] | m_radio_config->remote_config;
       m_radio_config->remote_config_background_retrieval_interval = doc["remote_config_background_retrieval_interval"] | m_radio_config->remote_config_background_retrieval_interval;
       m_radio_config->radio_id = doc["radio_id"] | m_radio_config->radio_id;
 
+      // The board is chosen at build time. The programmer still sends these, so a radio flashed with the wrong build is caught here.
+      const char *pcb_version = doc["pcb_version"] | Board::pcb_version;
+      bool has_channel_pot = doc["has_channel_pot"] | Board::has_channel_pot;
+      if (strcmp(pcb_version, Board::pcb_version) != 0 || has_channel_pot != Board::has_channel_pot) {
+        Serial.printf("WARNING: pcb_version=%s has_channel_pot=%d doesn't match this firmware's board profile (pcb_version=%s has_channel_pot=%d). Flash the firmware built for this board.\n",
+                      pcb_version, has_channel_pot, Board::pcb_version, Board::has_channel_pot);
+      }
+
       // should the stuff after | be there? if it works, then leave it alone
-      m_radio_config->has_channel_pot = doc["has_channel_pot"] | m_radio_config->has_channel_pot;
-      m_radio_config->pcb_version = doc["pcb_version"] | m_radio_config->pcb_version;
       m_radio_config->stn_1_url = doc["stn_1_url"] | m_radio_config->stn_1_url;
       m_radio_config->stn_2_url = doc["stn_2_url"] | m_radio_config->stn_2_url;
       m_radio_config->stn_3_url = doc["stn_3_url"] | m_radio_config->stn_3_url;
       m_radio_config->stn_4_url = doc["stn_4_url"] | m_radio_config->stn_4_url;
       m_radio_config->station_count = doc["station_count"] | m_radio_config->station_count;
       m_radio_config->max_station_count = doc["max_station_count"] | m_radio_config->max_station_count;
+      m_radio_config->sync_mode = doc["sync_mode"] | m_radio_config->sync_mode;
+      m_radio_config->sync_time_server = doc["sync_time_server"] | m_radio_config->sync_time_server;
+      if (doc.containsKey("sync_mode") || doc.containsKey("sync_time_server")) {
+        Serial.println("sync_mode and sync_time_server take effect after a restart.");
+      }
 
       put_config_to_preferences();
 
@@ -508,10 +652,13 @@ void Radio::handle_serial_input_() {
         bool cleared = preferences.clear();
         Serial.println("Clearing preferences, restarting for this to take effect.");
         preferences.end();
+        m_wifi_networks.clear();
         ESP.restart();
       }
 
       if (doc["reset_wifi"]) {
+        // The stored networks would be reconnected to at boot, before WiFiManager is started.
+        m_wifi_networks.clear();
         m_wifi_manager->resetSettings();
         Serial.println("Executing m_wifi_manager.resetSettings(), restarting for this to take effect.");
         ESP.restart();
@@ -520,15 +667,54 @@ void Radio::handle_serial_input_() {
       if (doc["debug_mode"]) {
         m_debug_mode = true;
         m_led_status.set_debug(true);
+        m_config_watcher.set_debug(true);
+        m_wifi_networks.set_debug(true);
+        m_recovery.set_debug(true);
+        m_memory.set_debug(true);
         m_wifi_manager->setDebugOutput(true);
       }
 
       if (doc["ssid"]) {
         String ssid = doc["ssid"];
         String pass = doc["pass"];
+        m_wifi_networks.add(ssid, pass);
         WiFi.begin(ssid.c_str(), pass.c_str(), 0, NULL, true);
       }
 
+      if (doc["forget_ssid"]) {
+        String ssid = doc["forget_ssid"];
+        m_wifi_networks.remove(ssid);
+      }
+
+      if (doc["wifi_networks"]) {
+        m_wifi_networks.print();
+      }
+
+      if (doc["state_stats"]) {
+        m_state_machine.print_stats();
+      }
+
+      if (doc["recovery_stats"]) {
+        m_recovery.print();
+      }
+
+      if (doc["sync_stats"]) {
+        m_playback_sync.print();
+      }
+
+      if (doc["fallback_stats"]) {
+        m_fallback_audio.print();
+      }
+
+      if (doc["memory_stats"]) {
+        m_memory.print();
+      }
+
+      if (doc["http_stats"]) {
+        m_config_http.print("config_http");
+        m_config_watcher.print();
+      }
+
       if (doc["restart_esp"]) {
         ESP.restart();
       }
@@ -580,6 +766,7 @@ Try
 
 
   audio->loop();
+  m_playback_sync.loop(audio);
 
   while (Serial.available() > 0) {
     handle_serial_input_();
@@ -589,131 +776,294 @@ Try
     debug_mode_loop();
   }
 
-  if (millis() > m_last_status_check_ + m_radio_config->status_check_interval_ms) {
+  // Nothing is due until the next deadline, so skip the status checks. This is a single comparison.
+  if (!m_scheduler.any_due()) {
+    return;
+  }
 
-    m_last_status_check_ = millis();
+  if (m_scheduler.run_every(RADIO_TIMER_MEMORY_CHECK, MEMORY_GUARD_CHECK_INTERVAL_MS)) {
+    check_memory_();
+  }
 
-    /*                                   */
-    /* Handle the WiFi connection status */
-    /*                                   */
+  // Background retrieval only runs at Idle. The timer is taken when it comes due, so it doesn't keep any_due() true while playing.
+  if (m_scheduler.take_due(RADIO_TIMER_BACKGROUND_CONFIG_RETRIEVAL)) {
+    m_config_retrieval_due_ = true;
+  }
 
-    if (WiFi.isConnected()) {
-      m_led_status.clear_status(RADIO_STATUS_400_WIFI_CONNECTION_LOST);
-      m_last_wifi_connected = millis();
-    } else {
-      if (m_debug_mode) Serial.println("Reconnecting to WiFi...");
-      m_led_status.set_status(RADIO_STATUS_400_WIFI_CONNECTION_LOST);
+  if (!m_scheduler.run_every(RADIO_TIMER_STATUS_CHECK, m_radio_config->status_check_interval_ms)) {
+    return;
+  }
 
-      // If it's been more than wifi_disconnect_timeout_ms since it's been connected to wifi, restart the esp.
-      if (millis() > m_last_wifi_connected + m_radio_config->wifi_disconnect_timeout_ms) {
-        ESP.restart();
-        return;
-      }
-      WiFi.reconnect();
-      return;
+  // Applied before the inputs are read, so a change to the selected station's URL is dispatched as a channel change in this status
+  // check, before run_state_() uses the URL.
+  if (m_state_machine.state() != RADIO_STATE_WIFI_LOST && m_config_watcher.has_config()) {
+    apply_remote_config_change_();
+  }
+
+  RadioState previous_state = m_state_machine.state();
+  RadioEvent event = read_event_();
+  if (m_state_machine.dispatch(event)) {
+    exit_state_(previous_state);
+    enter_state_(m_state_machine.state());
+    m_stream_stats.on_transition(previous_state, m_state_machine.state(), m_channel_index_output);
+    if (m_debug_mode) {
+      Serial.print("State: ");
+      Serial.print(RADIO_STATE_NAMES[previous_state]);
+      Serial.print(" -> ");
+      Serial.println(RADIO_STATE_NAMES[m_state_machine.state()]);
     }
+  }
+  run_state_(event);
+}
 
-    /*                                              */
-    /* Read inputs, set computed status properties. */
-    /*                                              */
+RadioEvent Radio::read_event_() {
+  // Reduces this status check's inputs to the single, highest priority event. See RadioEvent.
 
-    m_volume_input = read_volume();
-    m_play_input = (m_volume_input > 0);
-    m_channel_index_input = read_channel_index();
+  if (!WiFi.isConnected()) {
+    return RADIO_EVENT_WIFI_DOWN;
+  }
+
+  m_volume_input = read_volume();
+  m_play_input = (m_volume_input > 0);
+  m_channel_index_input = read_channel_index();
+
+  // Check for changes in the channel selected. If the channel has changed, stop the stream so the new one is a new connection, not a reconnection.
+  bool channel_changed = (m_channel_index_input != m_channel_index_output);
+  if (channel_changed) {
+    m_channel_index_output = m_channel_index_input;
+    audio->stopSong();
+  }
+
+  if (!m_play_input) {
+    return RADIO_EVENT_PLAY_OFF;
+  }
+
+  if (channel_changed) {
+    return RADIO_EVENT_CHANNEL_CHANGED;
+  }
+
+  // The fallback clip is not the stream, even though the audio library reports it as running and buffered.
+  if (m_fallback_audio.is_playing()) {
+    return RADIO_EVENT_STREAM_DOWN;
+  }
+
+  // The audio library reports the stream as not running while output is paused for a sync stretch.
+  if (!stream_is_running() && !m_playback_sync.is_stretching()) {
+    return RADIO_EVENT_STREAM_DOWN;
+  }
 
-    // Check for changes in the channel selected.  If the channel has changed, it is not connected and the new connection is not a reconnection.
-    if (m_channel_index_input != m_channel_index_output) {
-      m_channel_index_output = m_channel_index_input;
-      m_reconnecting_to_stream = false;
-      m_stream_connect_established = false;
+  // Once there is something in the buffer (ie: when more than just a connection to the host is made) it's playing.
+  return (audio->inBufferFilled() > 0) ? RADIO_EVENT_STREAM_FILLED : RADIO_EVENT_STREAM_EMPTY;
+}
+
+void Radio::enter_state_(RadioState state) {
+  switch (state) {
+    case RADIO_STATE_IDLE:
+      set_dac_sd_mode(false);  // Turn DAC off
+      m_fallback_audio.stop(audio);
       audio->stopSong();
-    }
+      m_recovery.on_idle();
+      break;
+    case RADIO_STATE_PLAYING:
+      m_recovery.on_playing();
+      break;
+    case RADIO_STATE_RECONNECTING:
+      // If the stream has not been seen for more than the time out, the esp is restarted.
+      m_scheduler.schedule(RADIO_TIMER_RECONNECT_WATCHDOG, m_radio_config->reconnecting_timeout_ms);
+      break;
+    case RADIO_STATE_WIFI_LOST:
+      // If WiFi has not been seen for more than the time out, the esp is restarted.
+      m_scheduler.schedule(RADIO_TIMER_WIFI_WATCHDOG, m_radio_config->wifi_disconnect_timeout_ms);
+      m_scheduler.schedule(RADIO_TIMER_WIFI_RECONNECT_ATTEMPT, 0);
+      m_wifi_networks.on_connection_lost();
+      break;
+    default:
+      break;
+  }
+}
 
-    // If play is requested and the stream had previously been connected, then the stream is reconnecting.
-    if (m_play_input && m_stream_connect_established && !stream_is_running()) {
-      m_stream_connect_established = false;
-      m_reconnecting_to_stream = true;
-    }
+void Radio::exit_state_(RadioState state) {
+  switch (state) {
+    case RADIO_STATE_PLAYING:
+      m_playback_sync.on_stopped(audio);
+      break;
+    case RADIO_STATE_RECONNECTING:
+      m_scheduler.cancel(RADIO_TIMER_RECONNECT_WATCHDOG);
+      m_scheduler.cancel(RADIO_TIMER_RECONNECT_ATTEMPT);
+      break;
+    case RADIO_STATE_WIFI_LOST:
+      // Leaving WiFiLost always means WiFi is connected again.
+      m_scheduler.cancel(RADIO_TIMER_WIFI_WATCHDOG);
+      m_scheduler.cancel(RADIO_TIMER_WIFI_RECONNECT_ATTEMPT);
+      m_led_status.clear_status(RADIO_STATUS_400_WIFI_CONNECTION_LOST);
+      m_wifi_networks.on_reconnected();
+      m_recovery.on_wifi_connected();
+      break;
+    default:
+      break;
+  }
+}
 
-    /*                           */
-    /* Handle playInput == false */
-    /*                           */
-
-    if (!m_play_input) {
-      // If the play input is false, but it was playing or reconnecting last cycle => disconnect.
-      if (m_stream_connect_established || stream_is_running() || m_reconnecting_to_stream) {
-        // stop play, set status
-        m_stream_connect_established = false;
-        m_reconnecting_to_stream = false;
-        set_dac_sd_mode(false);  // Turn DAC off
-        audio->stopSong();
-      }
-      // Clear warning level and up, since it doesn't matter if a connection cannot be made. This will still allow WiFi connection errors to be displayed.
-      m_led_status.set_status(RADIO_STATUS_001_IDLE, LED_STATUS_LEVEL_400_RED_ERROR);
+void Radio::schedule_config_retrieval_() {
+  // An interval of 0 or less turns background retrieval off. Arming the timer anyway would leave it due forever.
+  if (m_radio_config->remote_config_background_retrieval_interval > 0) {
+    m_scheduler.schedule(RADIO_TIMER_BACKGROUND_CONFIG_RETRIEVAL, m_radio_config->remote_config_background_retrieval_interval);
+  } else {
+    m_scheduler.cancel(RADIO_TIMER_BACKGROUND_CONFIG_RETRIEVAL);
+  }
+}
 
-      // Check the last time the configuration was downloaded, and download.
-      if (m_radio_config->remote_config && m_radio_config->remote_config_background_retrieval_interval > 0 && millis() - m_last_remote_config_retrieved_ > m_radio_config->remote_config_background_retrieval_interval) {
-        m_led_status.set_status(RADIO_STATUS_002_BACKGROUND_CONFIG_RETRIEVAL);
-        get_config_from_remote();
-      }
+void Radio::check_memory_() {
+  // The kept-alive config connections are standby resources (a TLS connection holds tens of KB of internal RAM), so they're dropped
+  // while memory is low. The next config download reconnects.
+  switch (m_memory.check()) {
+    case MEMORY_GUARD_LOW:
+      m_config_http.close();
+      m_config_watcher.set_paused(true);
+      break;
+
+    case MEMORY_GUARD_RECOVERED:
+      m_config_watcher.set_paused(false);
+      break;
+
+    default:
+      break;
+  }
+}
+
+void Radio::apply_remote_config_change_() {
+  // Applies the config the watcher downloaded on its own task, so this doesn't block audio->loop() on the network. If the selected
+  // station's URL changed, the stream is restarted as if the channel had been changed.
+  String selected_url = *station_url_(m_channel_index_output);
+
+  if (m_debug_mode) Serial.println("Config changed on the server, applying.");
+  bool error = apply_config_(m_config_watcher.config(), m_config_watcher.config_length());
+  m_config_watcher.release_config(!error);
 
+  if (*station_url_(m_channel_index_output) != selected_url) {
+    m_channel_index_output = -1;  // read_event_() sees a channel change, and stops the stream.
+  }
+}
+
+void Radio::recover_(RecoveryTier tier, int watchdog_timer, unsigned long watchdog_timeout_ms) {
+  switch (tier) {
+    case RECOVERY_TIER_AUDIO:
+      rebuild_audio_();
+      m_scheduler.cancel(RADIO_TIMER_RECONNECT_ATTEMPT);  // Reconnect on the next status check.
+      break;
+    case RECOVERY_TIER_WIFI:
+      rebuild_wifi_();
+      break;
+    default:
+      m_recovery.restart();
       return;
-    }
+  }
+
+  // Give this tier the same amount of time before escalating to the next one.
+  m_scheduler.schedule(watchdog_timer, watchdog_timeout_ms);
+}
 
-    /*                          */
-    /* Handle playInput == true */
-    /*                          */
+void Radio::rebuild_audio_() {
+  // Destroys and re-constructs the Audio instance in place, which frees and re-allocates its buffers and I2S driver. The pointer
+  // passed in from firmware.ino stays valid.
+  m_fallback_audio.stop(audio);
+  audio->stopSong();
+  audio->~Audio();
+  new (audio) Audio();
+  audio->setPinout(Board::pin_i2s_bclk, Board::pin_i2s_lrc, Board::pin_i2s_dout);
+  audio->setVolume(0);
+}
 
-    audio->setVolume(m_volume_input);
+void Radio::rebuild_wifi_() {
+  // Turns the WiFi stack off and on. WiFiNetworks reconnects from the WiFiLost state.
+  audio->stopSong();
+  WiFi.disconnect(true);
+  WiFi.mode(WIFI_OFF);
+  delay(100);
+  WiFi.mode(WIFI_STA);
+  m_scheduler.schedule(RADIO_TIMER_WIFI_RECONNECT_ATTEMPT, 0);
+}
 
-    // Play is requested, There is a connection to the host, and the stream is running. Make sure warnings are cleared and the success status is set.
-    if (m_play_input == true && stream_is_running()) {
-      m_reconnecting_to_stream = false;
-      m_stream_connect_established = true;
-      m_last_good_connection = millis();
+void Radio::run_state_(RadioEvent event) {
+  const RadioStateLED &led = m_state_machine.led();
+  m_led_status.set_status(led.status, led.force_to_status);
 
-      if (audio->inBufferFilled() > 0) {
-        // Once there is something in the buffer (ie: when more than just a connection to the host is made) update the status
-        m_led_status.set_status(RADIO_STATUS_201_PLAYING, LED_STATUS_LEVEL_400_RED_ERROR);
-      } else {
-        // If the buffer is still at 0, then blink blue.
-        m_led_status.set_status(RADIO_STATUS_151_BUFFERING, LED_STATUS_LEVEL_400_RED_ERROR);
+  switch (m_state_machine.state()) {
+    case RADIO_STATE_IDLE:
+      // Download the configuration if the background retrieval came due. Deferred while memory is low, a download opens a connection.
+      if (m_config_retrieval_due_ && m_radio_config->remote_config && !m_memory.is_low()) {
+        m_config_retrieval_due_ = false;
+        m_led_status.set_status(RADIO_STATUS_002_BACKGROUND_CONFIG_RETRIEVAL);
+        get_config_from_remote();
       }
-      return;
-    }
+      break;
 
-    // The input says to play, but there is no connection to the stream host.
-    if (m_play_input == true && !stream_is_running()) {
+    case RADIO_STATE_CONNECTING:
+      audio->setVolume(m_volume_input);
+      connect_to_stream_host();
+      break;
 
-      // Set the LED status.
-      if (m_reconnecting_to_stream) {
-        m_led_status.set_status(RADIO_STATUS_351_STREAM_CONNECTION_LOST_RECONNECTING);
-      } else {
-        m_led_status.set_status(RADIO_STATUS_102_INITIAL_STREAMING_CONNECTION, LED_STATUS_LEVEL_300_YELLOW_WARNING);
-      }
+    case RADIO_STATE_BUFFERING:
+      audio->setVolume(m_volume_input);
+      break;
 
-      // If it is a reconnect, only attempt if more than 5 seconds after last reconnecting attempt - giving 2 seconds to attempt a connection and fill the streaming buffer (making stream_is_running() true).
-      if (m_reconnecting_to_stream && millis() - 5000 > m_last_reconnection_attempt) {
-        m_last_reconnection_attempt = millis();
+    case RADIO_STATE_PLAYING:
+      audio->setVolume(m_volume_input);
+      m_stream_stats.on_playing(m_channel_index_output, audio->getBitRate());
+      m_playback_sync.on_playing(audio, *station_url_(m_channel_index_output));
+      break;
+
+    case RADIO_STATE_RECONNECTING:
+      audio->setVolume(m_volume_input);
+
+      if (m_scheduler.is_due(RADIO_TIMER_RECONNECT_WATCHDOG)) {
+        recover_(m_recovery.escalate(RECOVERY_TIER_AUDIO), RADIO_TIMER_RECONNECT_WATCHDOG, m_radio_config->reconnecting_timeout_ms);
+        return;
+      }
 
-        // TODO the amount of time to wait since the last reconnection should relate to the audio library's timeout for connections. 2000 millis is just what seems right.
+      // Only attempt once every reconnect_attempt_interval_ms - giving time to attempt a connection and fill the streaming buffer (making stream_is_running() true).
+      // TODO the amount of time to wait since the last reconnection should relate to the audio library's timeout for connections. 2000 millis is just what seems right.
+      if (m_scheduler.run_every(RADIO_TIMER_RECONNECT_ATTEMPT, m_radio_config->reconnect_attempt_interval_ms)) {
         // Stop any previous connection
         audio->stopSong();
-        // Connect
-        connect_to_stream_host();
+        // Connect. This stops the fallback clip.
+        if (!connect_to_stream_host()) {
+          m_fallback_audio.play(audio);
+        }
+      } else if (event == RADIO_EVENT_STREAM_DOWN) {
+        // Fill the time until the next attempt with the fallback clip. This also restarts the clip when it ends. The event is this
+        // status check's, so the stream isn't checked a second time.
+        m_fallback_audio.play(audio);
       }
+      break;
 
-      // If this isn't a reconnect, then connect
-      if (!m_reconnecting_to_stream) {
-        connect_to_stream_host();
+    case RADIO_STATE_WIFI_LOST:
+      // If it's been more than wifi_disconnect_timeout_ms since it's been connected to wifi, rebuild the WiFi stack, then restart the esp.
+      if (m_scheduler.is_due(RADIO_TIMER_WIFI_WATCHDOG)) {
+        recover_(m_recovery.escalate(RECOVERY_TIER_WIFI), RADIO_TIMER_WIFI_WATCHDOG, m_radio_config->wifi_disconnect_timeout_ms);
+        return;
       }
 
-      // If the stream is reconnecting and the stream has not been seen for more than the time out, restart the esp
-      // This could count retries in the block above? But this works as well.
-      if (m_reconnecting_to_stream && m_last_good_connection + m_radio_config->reconnecting_timeout_ms < millis()) {
-        ESP.restart();
-        return;
+      // Attempts are spaced out by WiFiNetworks' backoff, rather than made on every status check. While it scans, it's polled more often.
+      if (m_scheduler.is_due(RADIO_TIMER_WIFI_RECONNECT_ATTEMPT)) {
+        m_scheduler.schedule(RADIO_TIMER_WIFI_RECONNECT_ATTEMPT, m_wifi_networks.attempt_reconnect());
       }
-    }
+
+      // read_event_() stops at WIFI_DOWN, so the volume is read here to play the fallback clip until WiFi is back.
+      if (m_fallback_audio.available()) {
+        m_volume_input = read_volume();
+        if (m_volume_input > 0) {
+          set_dac_sd_mode(true);
+          audio->setVolume(m_volume_input);
+          m_fallback_audio.play(audio);
+        } else {
+          m_fallback_audio.stop(audio);
+          set_dac_sd_mode(false);
+        }
+      }
+      break;
+
+    default:
+      break;
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,264 @@
+/*
+
+Playback state machine.
+
+Every status check, Radio reads its inputs once and reduces them to a single event. The event is looked up in the transition table
+below, and the resulting state decides both the LED status and the work done during that status check.
+
+  Idle          Volume is at 0. The stream is stopped and the DAC is off.
+  Connecting    Volume is up and a first connection to the selected station is being made.
+  Buffering     Connected to the stream host, but nothing is in the buffer yet.
+  Playing       Connected, and the buffer has data.
+  Reconnecting  The stream was connected and has been lost. Attempts are spaced out and a watchdog is running.
+  WiFiLost      WiFi is disconnected. A watchdog is running. When WiFi is back and the stream is down, a stream that was up before
+                WiFi was lost (Buffering, Playing or Reconnecting) goes to Reconnecting, so it keeps the reconnect spacing, watchdog
+                and fallback clip. Otherwise it goes to Connecting. The table has Connecting, dispatch() applies the exception.
+
+The time spent in each state, the number of times each state was entered and the number of times each transition was taken are
+accumulated since boot (printed with {"state_stats": true}), and sent with the config check-in as the change since the last accepted
+check-in. States are numbered in RadioState order (0 Idle ... 5 WiFiLost):
+
+  state_ms=<ms per state>&state_entries=<entries per state>&state_transitions=<from>-<to>-<count>,...
+
+state_transitions only lists the transitions taken.
+
+*/
+
+enum RadioState {
+  RADIO_STATE_IDLE,
+  RADIO_STATE_CONNECTING,
+  RADIO_STATE_BUFFERING,
+  RADIO_STATE_PLAYING,
+  RADIO_STATE_RECONNECTING,
+  RADIO_STATE_WIFI_LOST,
+  RADIO_STATE_COUNT
+};
+
+// Events are listed in priority order. Only the first that applies is dispatched per status check.
+enum RadioEvent {
+  RADIO_EVENT_WIFI_DOWN,        // WiFi is not connected.
+  RADIO_EVENT_PLAY_OFF,         // Volume is at 0.
+  RADIO_EVENT_CHANNEL_CHANGED,  // A different station was selected. The previous stream has been stopped.
+  RADIO_EVENT_STREAM_DOWN,      // Volume is up, the stream is not running.
+  RADIO_EVENT_STREAM_EMPTY,     // Volume is up, the stream is running, the buffer is empty.
+  RADIO_EVENT_STREAM_FILLED,    // Volume is up, the stream is running, the buffer has data.
+  RADIO_EVENT_COUNT
+};
+
+const char *const RADIO_STATE_NAMES[RADIO_STATE_COUNT] = { "Idle", "Connecting", "Buffering", "Playing", "Reconnecting", "WiFiLost" };
+
+// RADIO_TRANSITIONS[current state][event] = next state
+const RadioState RADIO_TRANSITIONS[RADIO_STATE_COUNT][RADIO_EVENT_COUNT] = {
+  //                    WIFI_DOWN                 PLAY_OFF          CHANNEL_CHANGED          STREAM_DOWN               STREAM_EMPTY             STREAM_FILLED
+  /* Idle         */ { RADIO_STATE_WIFI_LOST, RADIO_STATE_IDLE, RADIO_STATE_CONNECTING, RADIO_STATE_CONNECTING,   RADIO_STATE_BUFFERING, RADIO_STATE_PLAYING },
+  /* Connecting   */ { RADIO_STATE_WIFI_LOST, RADIO_STATE_IDLE, RADIO_STATE_CONNECTING, RADIO_STATE_CONNECTING,   RADIO_STATE_BUFFERING, RADIO_STATE_PLAYING },
+  /* Buffering    */ { RADIO_STATE_WIFI_LOST, RADIO_STATE_IDLE, RADIO_STATE_CONNECTING, RADIO_STATE_RECONNECTING, RADIO_STATE_BUFFERING, RADIO_STATE_PLAYING },
+  /* Playing      */ { RADIO_STATE_WIFI_LOST, RADIO_STATE_IDLE, RADIO_STATE_CONNECTING, RADIO_STATE_RECONNECTING, RADIO_STATE_BUFFERING, RADIO_STATE_PLAYING },
+  /* Reconnecting */ { RADIO_STATE_WIFI_LOST, RADIO_STATE_IDLE, RADIO_STATE_CONNECTING, RADIO_STATE_RECONNECTING, RADIO_STATE_BUFFERING, RADIO_STATE_PLAYING },
+  /* WiFiLost     */ { RADIO_STATE_WIFI_LOST, RADIO_STATE_IDLE, RADIO_STATE_CONNECTING, RADIO_STATE_CONNECTING,   RADIO_STATE_BUFFERING, RADIO_STATE_PLAYING }
+};
+
+struct RadioStateLED {
+  int status;
+  int force_to_status;  // Passed to LEDStatus::set_status()
+};
+
+// The LED status set on every status check while in each state.
+const RadioStateLED RADIO_STATE_LEDS[RADIO_STATE_COUNT] = {
+  /* Idle         */ { RADIO_STATUS_001_IDLE, LED_STATUS_LEVEL_400_RED_ERROR },  // Clear warning level and up, since it doesn't matter if a connection cannot be made. This will still allow WiFi connection errors to be displayed.
+  /* Connecting   */ { RADIO_STATUS_102_INITIAL_STREAMING_CONNECTION, LED_STATUS_LEVEL_300_YELLOW_WARNING },
+  /* Buffering    */ { RADIO_STATUS_151_BUFFERING, LED_STATUS_LEVEL_400_RED_ERROR },
+  /* Playing      */ { RADIO_STATUS_201_PLAYING, LED_STATUS_LEVEL_400_RED_ERROR },
+  /* Reconnecting */ { RADIO_STATUS_351_STREAM_CONNECTION_LOST_RECONNECTING, LED_STATUS_UNSET },
+  /* WiFiLost     */ { RADIO_STATUS_400_WIFI_CONNECTION_LOST, LED_STATUS_UNSET }
+};
+
+class RadioStateMachine {
+public:
+  RadioStateMachine();
+  void init();
+  RadioState state();
+  bool dispatch(RadioEvent event);
+  const RadioStateLED &led();
+  unsigned long dwell_ms(RadioState state);
+  uint32_t entries(RadioState state);
+  uint32_t transitions(RadioState from, RadioState to);
+  void print_stats();
+  bool append_query(char *url, size_t url_size);
+  void reset_stats();
+
+private:
+  RadioState m_state_ = RADIO_STATE_IDLE;
+  RadioState m_state_before_wifi_lost_ = RADIO_STATE_IDLE;
+  unsigned long m_entered_at_ = 0;
+  unsigned long m_dwell_ms_[RADIO_STATE_COUNT];
+  uint32_t m_entries_[RADIO_STATE_COUNT];
+  uint32_t m_transitions_[RADIO_STATE_COUNT][RADIO_STATE_COUNT];
+
+  // The totals at the last accepted check-in, and at the one in progress (committed by reset_stats()).
+  unsigned long m_reported_dwell_ms_[RADIO_STATE_COUNT];
+  uint32_t m_reported_entries_[RADIO_STATE_COUNT];
+  uint32_t m_reported_transitions_[RADIO_STATE_COUNT][RADIO_STATE_COUNT];
+  unsigned long m_query_dwell_ms_[RADIO_STATE_COUNT];
+  uint32_t m_query_entries_[RADIO_STATE_COUNT];
+  uint32_t m_query_transitions_[RADIO_STATE_COUNT][RADIO_STATE_COUNT];
+};
+
+RadioStateMachine::RadioStateMachine() {
+  for (int i = 0; i < RADIO_STATE_COUNT; i++) {
+    m_dwell_ms_[i] = 0;
+    m_entries_[i] = 0;
+    m_reported_dwell_ms_[i] = 0;
+    m_reported_entries_[i] = 0;
+    m_query_dwell_ms_[i] = 0;
+    m_query_entries_[i] = 0;
+    for (int j = 0; j < RADIO_STATE_COUNT; j++) {
+      m_transitions_[i][j] = 0;
+      m_reported_transitions_[i][j] = 0;
+      m_query_transitions_[i][j] = 0;
+    }
+  }
+};
+
+/**
+ * Starts timing the current (Idle) state. Call once boot is complete, so the boot time isn't counted as Idle.
+ */
+void RadioStateMachine::init() {
+  m_entered_at_ = millis();
+  m_entries_[m_state_]++;
+}
+
+/**
+ * Returns the current state.
+ */
+RadioState RadioStateMachine::state() {
+  return m_state_;
+}
+
+/**
+ * Looks up the next state for the event and, if it differs from the current state, moves to it and updates the statistics.
+ *
+ * @param event The event derived from this status check's inputs.
+ * @return true if the state changed.
+ */
+bool RadioStateMachine::dispatch(RadioEvent event) {
+  RadioState next = RADIO_TRANSITIONS[m_state_][event];
+
+  // A stream that was up before WiFi was lost is reconnected, not connected from scratch.
+  if (m_state_ == RADIO_STATE_WIFI_LOST && event == RADIO_EVENT_STREAM_DOWN
+      && (m_state_before_wifi_lost_ == RADIO_STATE_BUFFERING || m_state_before_wifi_lost_ == RADIO_STATE_PLAYING
+          || m_state_before_wifi_lost_ == RADIO_STATE_RECONNECTING)) {
+    next = RADIO_STATE_RECONNECTING;
+  }
+
+  if (next == m_state_) return false;
+  if (next == RADIO_STATE_WIFI_LOST) m_state_before_wifi_lost_ = m_state_;
+
+  unsigned long now = millis();
+  m_dwell_ms_[m_state_] += now - m_entered_at_;
+  m_transitions_[m_state_][next]++;
+  m_entries_[next]++;
+  m_entered_at_ = now;
+  m_state_ = next;
+  return true;
+}
+
+/**
+ * Returns the LED status for the current state.
+ */
+const RadioStateLED &RadioStateMachine::led() {
+  return RADIO_STATE_LEDS[m_state_];
+}
+
+/**
+ * Returns the total milliseconds spent in a state, including the time so far if it is the current state.
+ */
+unsigned long RadioStateMachine::dwell_ms(RadioState state) {
+  unsigned long dwell = m_dwell_ms_[state];
+  if (state == m_state_) dwell += millis() - m_entered_at_;
+  return dwell;
+}
+
+/**
+ * Returns the number of times a state has been entered.
+ */
+uint32_t RadioStateMachine::entries(RadioState state) {
+  return m_entries_[state];
+}
+
+/**
+ * Returns the number of times the transition from one state to another has been taken.
+ */
+uint32_t RadioStateMachine::transitions(RadioState from, RadioState to) {
+  return m_transitions_[from][to];
+}
+
+/**
+ * Prints the dwell time and entry count of each state, and every transition that has been taken, to Serial.
+ */
+void RadioStateMachine::print_stats() {
+  Serial.print("state=");
+  Serial.println(RADIO_STATE_NAMES[m_state_]);
+  for (int i = 0; i < RADIO_STATE_COUNT; i++) {
+    RadioState state = (RadioState)i;
+    unsigned long dwell = dwell_ms(state);
+    uint32_t count = entries(state);
+    Serial.printf("  %s: entries=%u dwell_ms=%lu avg_ms=%lu\n", RADIO_STATE_NAMES[i], count, dwell, (count > 0) ? dwell / count : 0);
+  }
+  for (int i = 0; i < RADIO_STATE_COUNT; i++) {
+    for (int j = 0; j < RADIO_STATE_COUNT; j++) {
+      if (m_transitions_[i][j] > 0) {
+        Serial.printf("  %s->%s=%u\n", RADIO_STATE_NAMES[i], RADIO_STATE_NAMES[j], m_transitions_[i][j]);
+      }
+    }
+  }
+}
+
+/**
+ * Appends the dwell times, entries and transitions since the last reset_stats() to url. The totals are kept, so reset_stats() only
+ * removes what was sent, not what happened during the request.
+ *
+ * @param url A URL that already has a query string.
+ * @param url_size The size of the buffer url is in.
+ * @return true if anything was appended.
+ */
+bool RadioStateMachine::append_query(char *url, size_t url_size) {
+  char param[32];
+  strlcat(url, "&state_ms=", url_size);
+  for (int i = 0; i < RADIO_STATE_COUNT; i++) {
+    m_query_dwell_ms_[i] = dwell_ms((RadioState)i);
+    snprintf(param, sizeof(param), (i == 0) ? "%lu" : ",%lu", m_query_dwell_ms_[i] - m_reported_dwell_ms_[i]);
+    strlcat(url, param, url_size);
+  }
+  strlcat(url, "&state_entries=", url_size);
+  for (int i = 0; i < RADIO_STATE_COUNT; i++) {
+    m_query_entries_[i] = entries((RadioState)i);
+    snprintf(param, sizeof(param), (i == 0) ? "%u" : ",%u", m_query_entries_[i] - m_reported_entries_[i]);
+    strlcat(url, param, url_size);
+  }
+  bool first = true;
+  for (int i = 0; i < RADIO_STATE_COUNT; i++) {
+    for (int j = 0; j < RADIO_STATE_COUNT; j++) {
+      m_query_transitions_[i][j] = transitions((RadioState)i, (RadioState)j);
+      uint32_t count = m_query_transitions_[i][j] - m_reported_transitions_[i][j];
+      if (count == 0) continue;
+      snprintf(param, sizeof(param), first ? "&state_transitions=%d-%d-%u" : ",%d-%d-%u", i, j, count);
+      strlcat(url, param, url_size);
+      first = false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Marks what the last append_query() sent as reported. Call once the server has accepted it.
+ */
+void RadioStateMachine::reset_stats() {
+  for (int i = 0; i < RADIO_STATE_COUNT; i++) {
+    m_reported_dwell_ms_[i] = m_query_dwell_ms_[i];
+    m_reported_entries_[i] = m_query_entries_[i];
+    for (int j = 0; j < RADIO_STATE_COUNT; j++) {
+      m_reported_transitions_[i][j] = m_query_transitions_[i][j];
+    }
+  }
+}
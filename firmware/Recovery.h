@@ -0,0 +1,166 @@
+/*
+
+Tiered recovery, so a watchdog doesn't have to restart the ESP.
+
+When a watchdog expires, escalate() returns the cheapest tier that hasn't been tried yet in the current episode:
+
+  RECOVERY_TIER_AUDIO    Rebuild the Audio instance and its buffers. Playback state and everything else is kept.
+  RECOVERY_TIER_WIFI     Turn the WiFi stack off and on again, and reconnect.
+  RECOVERY_TIER_RESTART  ESP.restart(), the last resort.
+
+A stream watchdog starts at the audio tier, a WiFi watchdog starts at the WiFi tier. The episode ends (and the next one starts from
+the bottom again) once the radio is playing, or for WiFi episodes once WiFi is connected.
+
+The time from starting each tier to the radio being healthy again is recorded per tier. A restart is recorded in RTC memory, which
+survives a software reset, so the time from the restart until the radio plays again is recorded too.
+
+*/
+
+#define RECOVERY_RTC_MAGIC 0x52435652  // "RCVR"
+
+enum RecoveryTier {
+  RECOVERY_TIER_AUDIO,
+  RECOVERY_TIER_WIFI,
+  RECOVERY_TIER_RESTART,
+  RECOVERY_TIER_COUNT,
+  RECOVERY_TIER_NONE = -1
+};
+
+const char *const RECOVERY_TIER_NAMES[RECOVERY_TIER_COUNT] = { "audio", "wifi", "restart" };
+
+struct RecoveryTierStats {
+  uint32_t attempts = 0;
+  uint32_t recoveries = 0;
+  uint32_t last_ms = 0;
+  uint32_t max_ms = 0;
+};
+
+// Survives ESP.restart(), but not a power cycle.
+RTC_NOINIT_ATTR uint32_t g_recovery_rtc_magic;
+RTC_NOINIT_ATTR uint32_t g_recovery_rtc_restarts;
+
+class Recovery {
+public:
+  void init(bool debug = false);
+  RecoveryTier escalate(RecoveryTier lowest);
+  void on_playing();
+  void on_wifi_connected();
+  void on_idle();
+  void restart();
+  void print();
+  void set_debug(bool debug);
+
+private:
+  RecoveryTierStats m_stats_[RECOVERY_TIER_COUNT];
+  RecoveryTier m_next_tier_ = RECOVERY_TIER_AUDIO;
+  RecoveryTier m_pending_tier_ = RECOVERY_TIER_NONE;
+  bool m_pending_is_wifi_episode_ = false;
+  unsigned long m_pending_since_ = 0;
+  bool m_debug_ = false;
+
+  void complete_();
+};
+
+/**
+ * Picks up a restart recorded before the last software reset. Call once at boot.
+ *
+ * @param debug Optional. If true, recoveries are sent to the Serial output.
+ */
+void Recovery::init(bool debug) {
+  m_debug_ = debug;
+
+  if (g_recovery_rtc_magic == RECOVERY_RTC_MAGIC && esp_reset_reason() == ESP_RST_SW) {
+    // The restart was requested by restart(). Time the recovery from boot.
+    m_stats_[RECOVERY_TIER_RESTART].attempts = g_recovery_rtc_restarts;
+    m_pending_tier_ = RECOVERY_TIER_RESTART;
+    m_pending_since_ = 0;
+  } else {
+    g_recovery_rtc_restarts = 0;
+  }
+  g_recovery_rtc_magic = 0;
+}
+
+/**
+ * Returns the tier to run for an expired watchdog, and starts timing it. Each call in the same episode moves one tier up.
+ *
+ * @param lowest The cheapest tier that can fix the problem. RECOVERY_TIER_AUDIO for the stream, RECOVERY_TIER_WIFI for WiFi.
+ */
+RecoveryTier Recovery::escalate(RecoveryTier lowest) {
+  RecoveryTier tier = (m_next_tier_ > lowest) ? m_next_tier_ : lowest;
+  m_next_tier_ = (tier < RECOVERY_TIER_RESTART) ? (RecoveryTier)(tier + 1) : RECOVERY_TIER_RESTART;
+
+  if (m_pending_tier_ == RECOVERY_TIER_NONE) {
+    m_pending_is_wifi_episode_ = (lowest == RECOVERY_TIER_WIFI);
+  }
+  m_pending_tier_ = tier;
+  m_pending_since_ = millis();
+  m_stats_[tier].attempts++;
+
+  if (m_debug_) {
+    Serial.print("Recovery: ");
+    Serial.println(RECOVERY_TIER_NAMES[tier]);
+  }
+  return tier;
+}
+
+/**
+ * Ends the current episode as recovered. Call when the radio starts playing.
+ */
+void Recovery::on_playing() {
+  complete_();
+}
+
+/**
+ * Ends the current episode as recovered if it was started by losing WiFi. Call when WiFi is connected again.
+ */
+void Recovery::on_wifi_connected() {
+  if (m_pending_is_wifi_episode_) complete_();
+}
+
+/**
+ * Abandons the current episode without recording it, since the listener turned the radio off. Call when the radio goes idle.
+ */
+void Recovery::on_idle() {
+  if (m_pending_tier_ == RECOVERY_TIER_RESTART) return;  // Booting goes through Idle, keep timing until it plays.
+  m_pending_tier_ = RECOVERY_TIER_NONE;
+  m_next_tier_ = RECOVERY_TIER_AUDIO;
+}
+
+/**
+ * Records the restart in RTC memory and restarts the ESP.
+ */
+void Recovery::restart() {
+  g_recovery_rtc_magic = RECOVERY_RTC_MAGIC;
+  g_recovery_rtc_restarts = m_stats_[RECOVERY_TIER_RESTART].attempts;
+  ESP.restart();
+}
+
+/**
+ * Prints the attempts, recoveries and recovery times of each tier to Serial.
+ */
+void Recovery::print() {
+  for (int i = 0; i < RECOVERY_TIER_COUNT; i++) {
+    Serial.printf("recovery_%s: attempts=%u recoveries=%u last_ms=%u max_ms=%u\n", RECOVERY_TIER_NAMES[i], m_stats_[i].attempts, m_stats_[i].recoveries, m_stats_[i].last_ms, m_stats_[i].max_ms);
+  }
+}
+
+/**
+ * Enables or disables debug output.
+ */
+void Recovery::set_debug(bool debug) {
+  m_debug_ = debug;
+}
+
+void Recovery::complete_() {
+  if (m_pending_tier_ != RECOVERY_TIER_NONE) {
+    RecoveryTierStats &stats = m_stats_[m_pending_tier_];
+    uint32_t elapsed = millis() - m_pending_since_;
+    stats.recoveries++;
+    stats.last_ms = elapsed;
+    if (elapsed > stats.max_ms) stats.max_ms = elapsed;
+
+    if (m_debug_) Serial.printf("Recovery: %s recovered in %u ms\n", RECOVERY_TIER_NAMES[m_pending_tier_], elapsed);
+  }
+  m_pending_tier_ = RECOVERY_TIER_NONE;
+  m_next_tier_ = RECOVERY_TIER_AUDIO;
+}
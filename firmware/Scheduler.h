@@ -0,0 +1,124 @@
+/*
+
+Deadline scheduler for the radio's periodic work.
+
+Each timer is a slot in a fixed array, so nothing is allocated after construction. A timer is either unarmed or armed with an absolute
+deadline in millis(). The earliest armed deadline is cached whenever a timer is armed or cancelled, which makes any_due() a single
+comparison that the loop can make before doing any other work. The loop never sleeps until the next deadline, since audio->loop()
+has to be called on every pass. A due timer stays armed (and any_due() stays true) until it is re-scheduled, cancelled or taken with
+take_due(), so every armed timer must be serviced promptly or it defeats the check.
+
+All comparisons are done on the signed difference between two unsigned timestamps, which stays correct across the millis() rollover
+(~49.7 days) as long as no single delay is longer than ~24.8 days (LONG_MAX ms).
+https://arduino.stackexchange.com/questions/12587/how-can-i-handle-the-millis-rollover
+
+*/
+
+#define SCHEDULER_MAX_TIMERS 8
+
+class Scheduler {
+public:
+  Scheduler();
+  void schedule(int timer, unsigned long delay_ms);
+  void cancel(int timer);
+  bool is_due(int timer);
+  bool take_due(int timer);
+  bool run_every(int timer, unsigned long interval_ms);
+  bool any_due();
+
+  // Returns true if timestamp a is at or after timestamp b, correct across the millis() rollover.
+  static bool reached(unsigned long a, unsigned long b) {
+    return (long)(a - b) >= 0;
+  }
+
+private:
+  unsigned long m_deadlines_[SCHEDULER_MAX_TIMERS];
+  bool m_armed_[SCHEDULER_MAX_TIMERS];
+  unsigned long m_next_deadline_ = 0;
+  bool m_has_next_ = false;
+
+  void update_next_deadline_();
+};
+
+Scheduler::Scheduler() {
+  for (int i = 0; i < SCHEDULER_MAX_TIMERS; i++) {
+    m_deadlines_[i] = 0;
+    m_armed_[i] = false;
+  }
+};
+
+/**
+ * Arms a timer to become due delay_ms from now. Re-arming a timer that is already armed replaces its deadline.
+ *
+ * @param timer The timer slot (0 to SCHEDULER_MAX_TIMERS - 1).
+ * @param delay_ms Milliseconds from now until the timer is due. Must be less than LONG_MAX.
+ */
+void Scheduler::schedule(int timer, unsigned long delay_ms) {
+  m_deadlines_[timer] = millis() + delay_ms;
+  m_armed_[timer] = true;
+  update_next_deadline_();
+}
+
+/**
+ * Disarms a timer. Cancelling a timer that isn't armed does nothing.
+ *
+ * @param timer The timer slot.
+ */
+void Scheduler::cancel(int timer) {
+  if (!m_armed_[timer]) return;
+  m_armed_[timer] = false;
+  update_next_deadline_();
+}
+
+/**
+ * Returns true if the timer is armed and its deadline has been reached.
+ *
+ * @param timer The timer slot.
+ */
+bool Scheduler::is_due(int timer) {
+  return m_armed_[timer] && reached(millis(), m_deadlines_[timer]);
+}
+
+/**
+ * Returns true if the timer is due, and if so disarms it. For one-shot timers, so a due timer doesn't keep any_due() true.
+ *
+ * @param timer The timer slot.
+ */
+bool Scheduler::take_due(int timer) {
+  if (!is_due(timer)) return false;
+  cancel(timer);
+  return true;
+}
+
+/**
+ * Convenience for periodic work. Returns true if the timer is unarmed or due, and if so re-arms it interval_ms from now.
+ *
+ * An unarmed timer counts as due so that the first call runs immediately.
+ *
+ * @param timer The timer slot.
+ * @param interval_ms Milliseconds between runs.
+ * @return true if the periodic work should run now.
+ */
+bool Scheduler::run_every(int timer, unsigned long interval_ms) {
+  if (m_armed_[timer] && !reached(millis(), m_deadlines_[timer])) return false;
+  schedule(timer, interval_ms);
+  return true;
+}
+
+/**
+ * Returns true if any armed timer is due. This is O(1), since the earliest deadline is cached.
+ */
+bool Scheduler::any_due() {
+  return m_has_next_ && reached(millis(), m_next_deadline_);
+}
+
+void Scheduler::update_next_deadline_() {
+  m_has_next_ = false;
+  for (int i = 0; i < SCHEDULER_MAX_TIMERS; i++) {
+    if (!m_armed_[i]) continue;
+    if (!m_has_next_ || (long)(m_deadlines_[i] - m_next_deadline_) < 0) {
+      m_next_deadline_ = m_deadlines_[i];
+      m_has_next_ = true;
+    }
+  }
+}
@@ -0,0 +1,141 @@
+/*
+
+Per-station stream quality counters.
+
+The counters are accumulated between config check-ins and sent along with the request made by Radio::get_config_from_remote(),
+one query parameter per station that has activity:
+
+  stn<N>_stats=<connects>,<connect_ms_total>,<connect_ms_max>,<underruns>,<reconnects>,<kbytes_received>
+
+  connects          Number of times audio started playing after connecting or reconnecting.
+  connect_ms_total  Sum of the time from starting a connection (or losing one) until audio was playing. Divide by connects for the average.
+  connect_ms_max    Longest single time to audio.
+  underruns         Number of times the buffer emptied while playing (Playing -> Buffering).
+  reconnects        Number of times the stream was lost and had to be reconnected.
+  kbytes_received   Estimated from the stream's bitrate and the time spent playing. The audio library does not expose a byte count.
+
+The counters are cleared once the server has accepted them.
+
+*/
+
+#define STREAM_STATS_MAX_STATIONS 4
+
+struct StationStreamStats {
+  uint32_t connects = 0;
+  uint32_t connect_ms_total = 0;
+  uint32_t connect_ms_max = 0;
+  uint32_t underruns = 0;
+  uint32_t reconnects = 0;
+  uint32_t kbytes_received = 0;  // Counted in KB, since bytes would overflow a uint32_t after about 3 days at 128 kbps.
+  uint16_t bytes_pending = 0;    // Received bytes not yet counted in kbytes_received.
+};
+
+class StreamStats {
+public:
+  void on_transition(RadioState from, RadioState to, int station);
+  void on_playing(int station, uint32_t bitrate);
+  bool append_query(char *url, size_t url_size);
+  void reset();
+
+private:
+  StationStreamStats m_stations_[STREAM_STATS_MAX_STATIONS];
+  bool m_connect_pending_ = false;
+  unsigned long m_connect_started_at_ = 0;
+  unsigned long m_last_playing_sample_ = 0;
+};
+
+/**
+ * Updates the counters for a playback state transition. Call on every transition the RadioStateMachine makes.
+ *
+ * @param from The state that was left.
+ * @param to The state that was entered.
+ * @param station The index of the selected station.
+ */
+void StreamStats::on_transition(RadioState from, RadioState to, int station) {
+  if (station < 0 || station >= STREAM_STATS_MAX_STATIONS) return;
+  StationStreamStats &stats = m_stations_[station];
+
+  switch (to) {
+    case RADIO_STATE_CONNECTING:
+      m_connect_pending_ = true;
+      m_connect_started_at_ = millis();
+      break;
+
+    case RADIO_STATE_RECONNECTING:
+      stats.reconnects++;
+      m_connect_pending_ = true;
+      m_connect_started_at_ = millis();
+      break;
+
+    case RADIO_STATE_BUFFERING:
+      if (from == RADIO_STATE_PLAYING) stats.underruns++;
+      break;
+
+    case RADIO_STATE_PLAYING:
+      m_last_playing_sample_ = millis();
+      if (m_connect_pending_) {
+        uint32_t elapsed = millis() - m_connect_started_at_;
+        stats.connects++;
+        stats.connect_ms_total += elapsed;
+        if (elapsed > stats.connect_ms_max) stats.connect_ms_max = elapsed;
+        m_connect_pending_ = false;
+      }
+      break;
+
+    case RADIO_STATE_IDLE:
+    case RADIO_STATE_WIFI_LOST:
+      // The attempt was abandoned, not completed, so it isn't counted.
+      m_connect_pending_ = false;
+      break;
+
+    default:
+      break;
+  }
+}
+
+/**
+ * Accumulates the estimated bytes received since the last call. Call on every status check while playing.
+ *
+ * @param station The index of the selected station.
+ * @param bitrate The stream's bitrate in bits per second, as reported by the audio library. 0 if unknown.
+ */
+void StreamStats::on_playing(int station, uint32_t bitrate) {
+  if (station < 0 || station >= STREAM_STATS_MAX_STATIONS) return;
+  unsigned long now = millis();
+  uint32_t elapsed = now - m_last_playing_sample_;
+  m_last_playing_sample_ = now;
+  StationStreamStats &stats = m_stations_[station];
+  uint64_t bytes = ((uint64_t)bitrate * elapsed) / 8000 + stats.bytes_pending;
+  stats.kbytes_received += (uint32_t)(bytes / 1024);
+  stats.bytes_pending = bytes % 1024;
+}
+
+/**
+ * Appends a stn<N>_stats query parameter to url for each station with activity since the last reset().
+ *
+ * @param url A URL that already has a query string.
+ * @param url_size The size of the buffer url is in.
+ * @return true if anything was appended.
+ */
+bool StreamStats::append_query(char *url, size_t url_size) {
+  bool appended = false;
+  char param[96];
+  for (int i = 0; i < STREAM_STATS_MAX_STATIONS; i++) {
+    StationStreamStats &stats = m_stations_[i];
+    if (stats.connects == 0 && stats.reconnects == 0 && stats.underruns == 0 && stats.kbytes_received == 0) continue;
+    snprintf(param, sizeof(param), "&stn%d_stats=%u,%u,%u,%u,%u,%u", i + 1, stats.connects, stats.connect_ms_total, stats.connect_ms_max,
+             stats.underruns, stats.reconnects, stats.kbytes_received);
+    strlcat(url, param, url_size);
+    appended = true;
+  }
+  return appended;
+}
+
+/**
+ * Clears all counters. Call once the server has accepted them.
+ */
+void StreamStats::reset() {
+  for (int i = 0; i < STREAM_STATS_MAX_STATIONS; i++) {
+    m_stations_[i] = StationStreamStats();
+  }
+}
@@ -0,0 +1,411 @@
+/*
+
+Stores several WiFi networks and chooses between them when reconnecting.
+
+Up to WIFI_NETWORKS_MAX credentials are kept in the "wifi" preferences namespace, along with how often each has connected and failed.
+The BSSID and channel of the last access point connected to are cached as well.
+
+Reconnecting after the connection is lost:
+  - The first attempt goes straight to the cached access point (BSSID + channel), which skips the scan. This is the fast path when
+    the access point comes back or the drop was momentary.
+  - Later attempts scan, and pick the strongest known network, weighted by its past successes and the failures since it last
+    connected. In buildings with several access points this moves the radio to whichever one it can reach.
+  - The scan runs in the background (about 1.5 s), so the loop, and the fallback clip, keep running. attempt_reconnect() polls it.
+    Any connection attempt still in progress is stopped first (the ESP keeps its saved network), since a scan started while the
+    station is connecting fails.
+  - If the scan fails, or nothing stored is in range, the ESP reconnects to the network it remembers.
+  - Attempts are spaced out by an exponential backoff, from WIFI_NETWORKS_MIN_RETRY_DELAY_MS to WIFI_NETWORKS_MAX_RETRY_DELAY_MS.
+
+The time from losing the connection to reconnecting is recorded and sent with the config check-in:
+
+  wifi_reconnects=<count>&wifi_reconnect_ms_total=<ms>&wifi_reconnect_ms_max=<ms>
+
+Networks are added by WiFiManager (the network it connects to is remembered) or over serial ({"ssid": "...", "pass": "..."}).
+
+*/
+
+#define WIFI_NETWORKS_MAX 4
+#define WIFI_NETWORKS_MIN_RETRY_DELAY_MS 1000
+#define WIFI_NETWORKS_MAX_RETRY_DELAY_MS 30000
+#define WIFI_NETWORKS_SCAN_MS_PER_CHANNEL 120
+#define WIFI_NETWORKS_SCAN_POLL_MS 100
+#define WIFI_NETWORKS_SCAN_TIMEOUT_MS 5000
+#define WIFI_NETWORKS_SUCCESS_WEIGHT 3  // dB of RSSI each past success is worth, up to WIFI_NETWORKS_HISTORY_CAP successes.
+#define WIFI_NETWORKS_FAILURE_WEIGHT 6  // dB of RSSI each failure since the last success costs, up to WIFI_NETWORKS_HISTORY_CAP failures.
+#define WIFI_NETWORKS_HISTORY_CAP 5
+
+struct WiFiCredential {
+  String ssid = "";
+  String pass = "";
+  uint16_t successes = 0;
+  uint16_t failures = 0;
+};
+
+class WiFiNetworks {
+public:
+  void init(bool debug = false);
+  int count();
+  void add(const String &ssid, const String &pass);
+  bool remove(const String &ssid);
+  void clear();
+  bool connect_best();
+  void remember_connected();
+  void on_connection_lost();
+  unsigned long attempt_reconnect();
+  void on_reconnected();
+  bool append_query(char *url, size_t url_size);
+  void reset_stats();
+  void print();
+  void set_debug(bool debug);
+
+private:
+  Preferences m_preferences_;
+  WiFiCredential m_networks_[WIFI_NETWORKS_MAX];
+  int m_count_ = 0;
+  bool m_debug_ = false;
+
+  // Cached access point of the last successful connection.
+  int m_last_index_ = -1;
+  uint8_t m_last_bssid_[6] = { 0, 0, 0, 0, 0, 0 };
+  int32_t m_last_channel_ = 0;
+
+  // The current outage.
+  unsigned long m_lost_at_ = 0;
+  int m_attempt_ = 0;
+  int m_attempt_index_ = -1;
+  bool m_scanning_ = false;
+  unsigned long m_scan_started_at_ = 0;
+
+  // Reconnect times since the last check-in.
+  uint32_t m_reconnects_ = 0;
+  uint32_t m_reconnect_ms_total_ = 0;
+  uint32_t m_reconnect_ms_max_ = 0;
+
+  int find_(const String &ssid);
+  int score_(int index, int32_t rssi);
+  void begin_(int index, const uint8_t *bssid, int32_t channel);
+  bool begin_best_(int found);
+  bool start_scan_();
+  unsigned long next_delay_();
+  void save_();
+};
+
+/**
+ * Loads the stored networks. Call before using other methods.
+ *
+ * @param debug Optional. If true, reconnect attempts are sent to the Serial output.
+ */
+void WiFiNetworks::init(bool debug) {
+  m_debug_ = debug;
+  char key[16];
+  m_preferences_.begin("wifi", true);
+  m_count_ = min((int)m_preferences_.getInt("count", 0), WIFI_NETWORKS_MAX);
+  for (int i = 0; i < m_count_; i++) {
+    snprintf(key, sizeof(key), "ssid%d", i);
+    m_networks_[i].ssid = m_preferences_.getString(key, "");
+    snprintf(key, sizeof(key), "pass%d", i);
+    m_networks_[i].pass = m_preferences_.getString(key, "");
+    snprintf(key, sizeof(key), "ok%d", i);
+    m_networks_[i].successes = m_preferences_.getUShort(key, 0);
+    snprintf(key, sizeof(key), "fail%d", i);
+    m_networks_[i].failures = m_preferences_.getUShort(key, 0);
+  }
+  m_last_index_ = m_preferences_.getInt("last", -1);
+  m_last_channel_ = m_preferences_.getInt("chan", 0);
+  m_preferences_.getBytes("bssid", m_last_bssid_, sizeof(m_last_bssid_));
+  m_preferences_.end();
+
+  if (m_last_index_ >= m_count_) m_last_index_ = -1;
+}
+
+/**
+ * Returns the number of stored networks.
+ */
+int WiFiNetworks::count() {
+  return m_count_;
+}
+
+/**
+ * Stores a network, or updates the password of a stored one. When full, the network with the worst history is replaced.
+ */
+void WiFiNetworks::add(const String &ssid, const String &pass) {
+  if (ssid.length() == 0) return;
+
+  int index = find_(ssid);
+  if (index < 0 && m_count_ < WIFI_NETWORKS_MAX) {
+    index = m_count_++;
+  } else if (index < 0) {
+    index = 0;
+    for (int i = 1; i < m_count_; i++) {
+      if (score_(i, 0) < score_(index, 0)) index = i;
+    }
+    if (index == m_last_index_) m_last_index_ = -1;
+  }
+
+  if (m_networks_[index].ssid != ssid || m_networks_[index].pass != pass) {
+    m_networks_[index] = WiFiCredential();
+    m_networks_[index].ssid = ssid;
+    m_networks_[index].pass = pass;
+    save_();
+  }
+}
+
+/**
+ * Removes a stored network.
+ *
+ * @return true if the network was stored.
+ */
+bool WiFiNetworks::remove(const String &ssid) {
+  int index = find_(ssid);
+  if (index < 0) return false;
+
+  for (int i = index; i < m_count_ - 1; i++) {
+    m_networks_[i] = m_networks_[i + 1];
+  }
+  m_count_--;
+  m_networks_[m_count_] = WiFiCredential();
+
+  if (m_last_index_ == index) {
+    m_last_index_ = -1;
+  } else if (m_last_index_ > index) {
+    m_last_index_--;
+  }
+  save_();
+  return true;
+}
+
+/**
+ * Forgets every stored network and the cached access point, and erases them from preferences.
+ */
+void WiFiNetworks::clear() {
+  for (int i = 0; i < m_count_; i++) {
+    m_networks_[i] = WiFiCredential();
+  }
+  m_count_ = 0;
+  m_last_index_ = -1;
+  m_last_channel_ = 0;
+  memset(m_last_bssid_, 0, sizeof(m_last_bssid_));
+  m_preferences_.begin("wifi", false);
+  m_preferences_.clear();
+  m_preferences_.end();
+}
+
+/**
+ * Scans and begins connecting to the best stored network in range. Does not wait for the connection, but blocks for the scan, so it's
+ * only used during setup. attempt_reconnect() scans in the background.
+ *
+ * @return true if a stored network was in range.
+ */
+bool WiFiNetworks::connect_best() {
+  if (m_count_ == 0) return false;
+
+  // A scan started while the station is still connecting fails. The ESP keeps its saved network (eraseap=false).
+  WiFi.disconnect(false, false);
+  return begin_best_(WiFi.scanNetworks(false, false, false, WIFI_NETWORKS_SCAN_MS_PER_CHANNEL));
+}
+
+bool WiFiNetworks::begin_best_(int found) {
+  // Begins connecting to the best stored network in the scan results, then frees them. found is negative if the scan failed.
+  int best_index = -1;
+  int best_scan = -1;
+  int best_score = INT_MIN;
+  for (int i = 0; i < found; i++) {
+    int index = find_(WiFi.SSID(i));
+    if (index < 0) continue;
+    int score = score_(index, WiFi.RSSI(i));
+    if (score > best_score) {
+      best_score = score;
+      best_index = index;
+      best_scan = i;
+    }
+  }
+
+  if (best_index >= 0) {
+    if (m_debug_) Serial.printf("WiFi: best network is %s (rssi=%d score=%d)\n", m_networks_[best_index].ssid.c_str(), WiFi.RSSI(best_scan), best_score);
+    begin_(best_index, WiFi.BSSID(best_scan), WiFi.channel(best_scan));
+  }
+  WiFi.scanDelete();
+  return best_index >= 0;
+}
+
+/**
+ * Records the network WiFi is connected to as a success, stores it if it's new (ie: it was set up with WiFiManager) and caches its
+ * access point for the next fast reconnect.
+ */
+void WiFiNetworks::remember_connected() {
+  if (!WiFi.isConnected()) return;
+
+  add(WiFi.SSID(), WiFi.psk());
+  int index = find_(WiFi.SSID());
+  if (index < 0) return;
+
+  if (m_networks_[index].successes < UINT16_MAX) m_networks_[index].successes++;
+  m_networks_[index].failures = 0;  // Only failures since the last success count against a network.
+  m_last_index_ = index;
+  m_last_channel_ = WiFi.channel();
+  memcpy(m_last_bssid_, WiFi.BSSID(), sizeof(m_last_bssid_));
+  save_();
+}
+
+/**
+ * Starts timing an outage. Call when the WiFi connection is lost.
+ */
+void WiFiNetworks::on_connection_lost() {
+  m_lost_at_ = millis();
+  m_attempt_ = 0;
+  m_attempt_index_ = -1;
+  m_scanning_ = false;
+}
+
+/**
+ * Makes the next reconnect attempt, or checks on the scan for it. Does not wait for the connection or the scan.
+ *
+ * @return The number of milliseconds to wait before calling again.
+ */
+unsigned long WiFiNetworks::attempt_reconnect() {
+  if (m_scanning_) {
+    int found = WiFi.scanComplete();
+    if (found == WIFI_SCAN_RUNNING && millis() - m_scan_started_at_ < WIFI_NETWORKS_SCAN_TIMEOUT_MS) {
+      return WIFI_NETWORKS_SCAN_POLL_MS;
+    }
+    m_scanning_ = false;
+    if (!begin_best_(found)) {
+      // The scan failed or nothing stored is in range, fall back to the network the ESP remembers.
+      if (m_debug_) Serial.printf("WiFi: no stored network found (scan=%d), reconnecting.\n", found);
+      WiFi.reconnect();
+    }
+    return next_delay_();
+  }
+
+  // The previous attempt didn't connect.
+  if (m_attempt_index_ >= 0 && m_networks_[m_attempt_index_].failures < UINT16_MAX) {
+    m_networks_[m_attempt_index_].failures++;
+  }
+  m_attempt_index_ = -1;
+
+  if (m_attempt_ == 0 && m_last_index_ >= 0) {
+    if (m_debug_) Serial.printf("WiFi: fast reconnect to %s on channel %d\n", m_networks_[m_last_index_].ssid.c_str(), m_last_channel_);
+    begin_(m_last_index_, m_last_bssid_, m_last_channel_);
+  } else if (start_scan_()) {
+    return WIFI_NETWORKS_SCAN_POLL_MS;
+  } else {
+    // Nothing is stored, or the scan couldn't start, fall back to the network the ESP remembers.
+    if (m_debug_) Serial.println("WiFi: not scanning, reconnecting.");
+    WiFi.reconnect();
+  }
+  return next_delay_();
+}
+
+unsigned long WiFiNetworks::next_delay_() {
+  // The backoff once an attempt has begun.
+  unsigned long delay_ms = (unsigned long)WIFI_NETWORKS_MIN_RETRY_DELAY_MS << min(m_attempt_, 5);
+  m_attempt_++;
+  return min(delay_ms, (unsigned long)WIFI_NETWORKS_MAX_RETRY_DELAY_MS);
+}
+
+/**
+ * Records the time it took to reconnect and remembers the access point. Call when the connection is back.
+ */
+void WiFiNetworks::on_reconnected() {
+  uint32_t elapsed = millis() - m_lost_at_;
+  m_reconnects_++;
+  m_reconnect_ms_total_ += elapsed;
+  if (elapsed > m_reconnect_ms_max_) m_reconnect_ms_max_ = elapsed;
+  m_attempt_index_ = -1;
+  m_scanning_ = false;
+
+  if (m_debug_) Serial.printf("WiFi: reconnected to %s in %u ms after %d attempts\n", WiFi.SSID().c_str(), elapsed, m_attempt_);
+  remember_connected();
+}
+
+/**
+ * Appends the reconnect times since the last reset_stats() to url.
+ *
+ * @param url A URL that already has a query string.
+ * @param url_size The size of the buffer url is in.
+ * @return true if anything was appended.
+ */
+bool WiFiNetworks::append_query(char *url, size_t url_size) {
+  if (m_reconnects_ == 0) return false;
+  char param[96];
+  snprintf(param, sizeof(param), "&wifi_reconnects=%u&wifi_reconnect_ms_total=%u&wifi_reconnect_ms_max=%u", m_reconnects_, m_reconnect_ms_total_, m_reconnect_ms_max_);
+  strlcat(url, param, url_size);
+  return true;
+}
+
+/**
+ * Clears the reconnect times. Call once the server has accepted them.
+ */
+void WiFiNetworks::reset_stats() {
+  m_reconnects_ = 0;
+  m_reconnect_ms_total_ = 0;
+  m_reconnect_ms_max_ = 0;
+}
+
+/**
+ * Prints the stored networks (without passwords) and reconnect times to Serial.
+ */
+void WiFiNetworks::print() {
+  Serial.printf("wifi_networks=%d\n", m_count_);
+  for (int i = 0; i < m_count_; i++) {
+    Serial.printf("  %s successes=%u failures=%u%s\n", m_networks_[i].ssid.c_str(), m_networks_[i].successes, m_networks_[i].failures, (i == m_last_index_) ? " (last)" : "");
+  }
+  Serial.printf("wifi_reconnects=%u wifi_reconnect_ms_total=%u wifi_reconnect_ms_max=%u\n", m_reconnects_, m_reconnect_ms_total_, m_reconnect_ms_max_);
+}
+
+/**
+ * Enables or disables debug output.
+ */
+void WiFiNetworks::set_debug(bool debug) {
+  m_debug_ = debug;
+}
+
+int WiFiNetworks::find_(const String &ssid) {
+  for (int i = 0; i < m_count_; i++) {
+    if (m_networks_[i].ssid == ssid) return i;
+  }
+  return -1;
+}
+
+int WiFiNetworks::score_(int index, int32_t rssi) {
+  int successes = min((int)m_networks_[index].successes, WIFI_NETWORKS_HISTORY_CAP);
+  int failures = min((int)m_networks_[index].failures, WIFI_NETWORKS_HISTORY_CAP);
+  return rssi + successes * WIFI_NETWORKS_SUCCESS_WEIGHT - failures * WIFI_NETWORKS_FAILURE_WEIGHT;
+}
+
+void WiFiNetworks::begin_(int index, const uint8_t *bssid, int32_t channel) {
+  m_attempt_index_ = index;
+  WiFi.begin(m_networks_[index].ssid.c_str(), m_networks_[index].pass.c_str(), channel, bssid, true);
+}
+
+bool WiFiNetworks::start_scan_() {
+  // Starts a background scan. A scan started while the station is still connecting fails, so the attempt in progress is stopped first.
+  // The ESP keeps its saved network (eraseap=false) for WiFi.reconnect().
+  if (m_count_ == 0) return false;
+  WiFi.disconnect(false, false);
+  if (WiFi.scanNetworks(true, false, false, WIFI_NETWORKS_SCAN_MS_PER_CHANNEL) != WIFI_SCAN_RUNNING) return false;
+  m_scanning_ = true;
+  m_scan_started_at_ = millis();
+  return true;
+}
+
+void WiFiNetworks::save_() {
+  // IMPORTANT the preferences library accepts keys up to 15 characters.
+  char key[16];
+  m_preferences_.begin("wifi", false);
+  m_preferences_.putInt("count", m_count_);
+  for (int i = 0; i < m_count_; i++) {
+    snprintf(key, sizeof(key), "ssid%d", i);
+    m_preferences_.putString(key, m_networks_[i].ssid);
+    snprintf(key, sizeof(key), "pass%d", i);
+    m_preferences_.putString(key, m_networks_[i].pass);
+    snprintf(key, sizeof(key), "ok%d", i);
+    m_preferences_.putUShort(key, m_networks_[i].successes);
+    snprintf(key, sizeof(key), "fail%d", i);
+    m_preferences_.putUShort(key, m_networks_[i].failures);
+  }
+  m_preferences_.putInt("last", m_last_index_);
+  m_preferences_.putInt("chan", m_last_channel_);
+  m_preferences_.putBytes("bssid", m_last_bssid_, sizeof(m_last_bssid_));
+  m_preferences_.end();
+}
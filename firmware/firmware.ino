@@ -2,10 +2,13 @@
 
 Example serial messages for configuring the radio. It is too large to send all at once, so it is broken into parts.
 
+pcb_version and has_channel_pot are set by the board profile the firmware is built for (RADIO_BOARD_* below). If they are sent and
+don't match the build, a warning is printed.
+
 {
   "remote_cfg_url":"http://config.example.com/api/v1/radios/device_interface/v1.0/",
   "radio_id":"test-radio",
-  "pcb_version":"v1-USMX.beta-1",
+  "pcb_version":"v1.0-USMX",
   "remote_config":true,
   "has_channel_pot":true,
   "station_count":4
@@ -30,7 +33,42 @@ Example message for resetting the stored preferences and restarting the ESP.
 {"clear_preferences": true}
 {"restart_esp": true}
 
-TODO document: reset_wifi, debug_mode, ssid, pass
+Example message for printing the time spent in each playback state and the transitions taken (see RadioStateMachine.h).
+
+{"state_stats": true}
+
+Example messages for managing the stored WiFi networks (see WiFiNetworks.h). Up to 4 are stored, the radio picks between them by signal strength and past success.
+reset_wifi and clear_preferences forget all of them.
+
+{"ssid": "my-network", "pass": "my-password"}
+{"forget_ssid": "my-network"}
+{"wifi_networks": true}
+
+Example message for turning on multi-room sync (see PlaybackSync.h), and for printing the achieved skew. sync_mode and sync_time_server
+take effect after a restart. Without sync_time_server, pool.ntp.org is used.
+
+{"sync_mode": true, "sync_time_server": "192.168.1.10"}
+{"sync_stats": true}
+
+Example message for printing whether a fallback clip is provisioned and how much it has played (see FallbackAudio.h).
+
+{"fallback_stats": true}
+
+Example message for an https:// remote_cfg_url: the CA certificate (PEM, with \n line breaks) the config server is verified with. It
+is applied on the next restart. Without it, https:// config URLs aren't fetched.
+
+{"remote_cfg_ca": "-----BEGIN CERTIFICATE-----\nMIID...\n-----END CERTIFICATE-----\n"}
+
+Example message for printing how often the config server connections were reused, and the connect and transfer times (see
+ConfigHttpSession.h).
+
+{"http_stats": true}
+
+Example message for printing the memory pools, the current heap and the low watermarks, per 5 minute window (see MemoryGuard.h).
+
+{"memory_stats": true}
+
+TODO document: reset_wifi, debug_mode
 
 States: 
   - Green               LED_STATUS_SUCCESS              success
@@ -45,6 +83,9 @@ States:
 */
 #define FIRMWARE_VERSION "v1.0.0-beta.6"
 
+// The board this firmware is built for. See BoardProfiles.h for the available profiles.
+#define RADIO_BOARD_V1_0_USMX
+
 #include <WiFiManager.h>
 #include "Audio.h"
 #include "Radio.h"
@@ -5,31 +5,42 @@
 
 # Auto detect the serial port and write firmware.
 # python serial_programmer.py write_firmware -d --firmware-version v1.0.0-beta.2
+# Firmware built with board profiles has a build per PCB, pick it with --pcb-version.
+# python serial_programmer.py write_firmware -d --firmware-version v1.0.0-beta.7 --pcb-version v1.0-USSX
 
 # Auto detect the serial port and create from a config file.
 # python serial_programmer.py create -d --file settings.json
 
+# Flash and configure every attached radio at once. Each radio is given a new radio_id and created on the server.
+# python serial_programmer.py provision -d --file settings.json -V v1.0.0-beta.6
+
 
 import serial
 import json
+import os
+import sys
 import argparse
 import requests
-from time import sleep
+import subprocess
+from concurrent.futures import ThreadPoolExecutor
+from time import sleep, time
+from uuid import uuid1
 from qr_code_webcam import detect_and_decode_qr
 import esptool
 from libs.detect_serial_ports import serial_ports
 
 parser = argparse.ArgumentParser(description='Command line radio configuration.')
 
-parser.add_argument('action', help='Action to be performed.', choices=['create', 'update', 'write_firmware'])
+parser.add_argument('action', help='Action to be performed.', choices=['create', 'update', 'write_firmware', 'provision'])
 
 parser.add_argument('-a', '--api-version',  default='v1', type=str, help='Version of the api to use. Default: v1') 
-parser.add_argument('-b', '--pcb-version', type=str, help='PCB version.')
+parser.add_argument('-b', '--pcb-version', type=str, help='PCB version. Also selects the firmware build, for versions with a build per PCB.')
 parser.add_argument('-c', '--config-endpoint-version', type=str, default='v1.0', help='v1.0')
 parser.add_argument('-d', '--auto-detect-serial-port', action='store_true', default=False, help='Attempt to detect a serial port and write to it. UNPLUG OTHER SERIAL DEVICES.')
 parser.add_argument('-e', '--has-channel-pot', default=True, type=bool, help='has_channel_pot')
 parser.add_argument('-f', '--file', help='Path to the settings file')
 parser.add_argument('-H', '--host', type=str, help='Host of the radio configuration server.') 
+parser.add_argument('-j', '--jobs', type=int, default=None, help='provision: Number of radios to provision at once. Default: all of them')
 # parser.add_argument('-i', '--radio-id', type=str, help='ID of the radio. If blank, it will use the webcam to scan for a QR code that contains a URL that ends in a UUID and it will create a radio in the database.')
 parser.add_argument('-l', '--label', type=str, help='Label for the radio.')
 parser.add_argument('-n', '--network', type=int, help='network_id of the network to which the radio belongs.')
@@ -37,23 +48,65 @@ parser.add_argument('-p', '--password', type=str, help='Password for the configu
 parser.add_argument('-r', '--remote-config-background-retrieval-interval', default=43200000, type=int, help='remote_config_background_retrieval_interval')
 parser.add_argument('-s', '--default-station', default=None, type=str, help='Default station to be written into position 0.')
 parser.add_argument('-t', '--target', default=None, type=str, help='Target device to write to. Default: /dev/ttyACM0')
+parser.add_argument('-T', '--targets', nargs='+', default=None, help='provision: Target devices to write to. Use -d to provision every attached device instead.')
 parser.add_argument('-u', '--user', type=str, help='User name for the configuration server.')
 parser.add_argument('-V', '--firmware-version', type=str, help='Version used when writing firmware. Ex: v1.0.0')
 parser.add_argument('-w', '--wifi', action='store_true', help='Configure the radio to connect to the default WiFi Network.')
 
 args = parser.parse_args()
 
-def read_config(ser):
-    ser.flush()
-    ser.write("{}".encode())
+SERIAL_TIMEOUT_S = 1           # readline() returns after this long without a line.
+BOOT_TIMEOUT_S = 60            # Time for a radio to boot far enough to read serial (it connects to WiFi first).
+ECHO_TIMEOUT_S = 10            # Time for a radio to echo a message back.
+FLASH_TIMEOUT_S = 300
+PORT_REAPPEAR_TIMEOUT_S = 30   # A hard reset re-enumerates the radio's USB serial port.
+IGNORE_PORTS = ['/dev/ttyS0']
+
+def detect_radio_ports():
+    return [p for p in serial_ports() if p not in IGNORE_PORTS]
+
+def readline(ser):
+    return ser.read_until(b'\n').decode(errors='replace').strip()
+
+def wait_for_echo(ser, payload, timeout=ECHO_TIMEOUT_S):
+    # handle_serial_input_() echoes every message it parses, before applying it. Lines that aren't the echo are skipped.
+    deadline = time() + timeout
+    while time() < deadline:
+        line = readline(ser)
+        if not line:
+            continue
+        try:
+            if json.loads(line) == payload:
+                return True
+        except ValueError:
+            pass
+    return False
+
+def read_config(ser, timeout=BOOT_TIMEOUT_S, verbose=True):
+    # Sends {} until the radio echoes it (it only reads serial once it has booted), then returns the key=value lines it prints.
+    ser.reset_input_buffer()
+    deadline = time() + timeout
     while True:
+        if time() > deadline:
+            raise Exception("The radio didn't respond")
         ser.write("{}".encode())
-        sleep(0.25)
-        print('.', end='', flush=True)
-        data = ser.read_all().decode().strip()
-        if data:
-            print(data, flush=True)
+        if verbose:
+            print('.', end='', flush=True)
+        if wait_for_echo(ser, {}, timeout=SERIAL_TIMEOUT_S):
+            break
+
+    config = {}
+    deadline = time() + ECHO_TIMEOUT_S
+    while time() < deadline:
+        line = readline(ser)
+        if not line:
             break
+        if verbose:
+            print(line, flush=True)
+        key, separator, value = line.partition('=')
+        if separator:
+            config[key] = value
+    return config
 
 def create_radio(args, radio_id):
     with requests.Session() as session:
@@ -102,9 +155,8 @@ def write_to_serial(ser, payload):
     
     # Write the payload to the serial port
     # The encode() method converts the string to bytes, which is required by the write() method
-    print(f"Writing: {payload}")
+    print(f"Writing: {payload}", flush=True)
     ser.write(payload.encode())
-    sleep(0.2)
 
 
 def update_radio(ser, args, radio_id):
@@ -127,12 +179,135 @@ def update_radio(ser, args, radio_id):
 def write_key_value_to_serial(ser, key, value):
     kv = {key:value}
     write_to_serial(ser, kv)
-    while True:
-        sleep(0.1)
-        data = ser.read_all().decode().strip()
-        if data:
-            break
-    sleep(0.1)
+    if not wait_for_echo(ser, kv):
+        raise Exception(f"The radio didn't echo {key}")
+
+def find_firmware_dir(firmware_version, pcb_version):
+    # The pins and pcb_version are compiled in (see firmware/BoardProfiles.h), so those versions have a build per PCB:
+    # ./<firmware version>/<pcb version>/. Versions from before board profiles have a single build in ./<firmware version>/.
+    version_dir = f'./{firmware_version}'
+    if not os.path.isdir(version_dir):
+        raise Exception(f"No firmware found in {version_dir}")
+    boards = sorted(d for d in os.listdir(version_dir) if os.path.isdir(os.path.join(version_dir, d)))
+    if not boards:
+        return version_dir
+    if pcb_version not in boards:
+        raise Exception(f"{firmware_version} has a build per PCB. Pass --pcb-version with one of: {', '.join(boards)}")
+    return f'{version_dir}/{pcb_version}'
+
+def esptool_write_flash_args(port, firmware_dir):
+    return ['--chip', 'esp32s3', '--port', port, '--baud', '921600',  '--before', 
+            'default_reset', '--after', 'hard_reset', 'write_flash',  '-z', 
+            '--flash_mode', 'dio', '--flash_freq', '80m', '--flash_size', '4MB', 
+            '0x0', f'{firmware_dir}/firmware.ino.bootloader.bin', '0x8000', 
+            f'{firmware_dir}/firmware.ino.partitions.bin', '0xe000', 
+            './libs/esp32s3-2.0.14.boot_app0.bin', '0x10000', 
+            f'{firmware_dir}/firmware.ino.bin']
+
+def firmware_size(firmware_dir):
+    files = ['firmware.ino.bootloader.bin', 'firmware.ino.partitions.bin', 'firmware.ino.bin']
+    return sum(os.path.getsize(f'{firmware_dir}/{f}') for f in files) + os.path.getsize('./libs/esp32s3-2.0.14.boot_app0.bin')
+
+def flash_firmware(port, firmware_dir):
+    # esptool.main() keeps global state and prints to stdout, so each port is flashed in its own process.
+    result = subprocess.run([sys.executable, '-m', 'esptool'] + esptool_write_flash_args(port, firmware_dir),
+                            capture_output=True, text=True, timeout=FLASH_TIMEOUT_S)
+    mac = next((line.split('MAC:')[1].strip() for line in result.stdout.splitlines() if 'MAC:' in line), None)
+    if result.returncode != 0:
+        last_line = (result.stdout.strip().splitlines() or [''])[-1]
+        raise Exception(f"esptool failed: {last_line}")
+    return mac
+
+def wait_for_port(port):
+    deadline = time() + PORT_REAPPEAR_TIMEOUT_S
+    while time() < deadline:
+        try:
+            serial.Serial(port).close()
+            return
+        except (OSError, serial.SerialException):
+            sleep(0.5)
+    raise Exception(f"{port} didn't come back after flashing")
+
+def provision_radio(port, args):
+    # Flashes (if a firmware version was given) and configures one radio. Runs in its own thread, one per port.
+    report = {'port': port, 'mac': None, 'radio_id': None, 'flash_s': None, 'flash_kbps': None, 'config_s': None, 'error': None}
+    start = time()
+    try:
+        if args.firmware_version:
+            print(f"[{port}] Writing firmware {args.firmware_dir}", flush=True)
+            report['mac'] = flash_firmware(port, args.firmware_dir)
+            report['flash_s'] = time() - start
+            report['flash_kbps'] = firmware_size(args.firmware_dir) / 1024 / report['flash_s']
+            wait_for_port(port)
+
+        config_start = time()
+        with serial.Serial(port, 115200, timeout=SERIAL_TIMEOUT_S) as ser:
+            read_config(ser, verbose=False)
+
+            settings = {}
+            if args.host:
+                radio_id = str(uuid1())
+                create_radio(args, radio_id)
+                report['radio_id'] = radio_id
+                settings['remote_config'] = True
+                settings['radio_id'] = radio_id
+                settings['remote_cfg_url'] = f"{args.host}/api/{args.api_version}/radios/device_interface/{args.config_endpoint_version}/"
+                settings['remote_config_background_retrieval_interval'] = args.remote_config_background_retrieval_interval
+            settings['has_channel_pot'] = args.has_channel_pot
+            if args.pcb_version:
+                settings['pcb_version'] = args.pcb_version
+            if args.default_station:
+                settings['stn_1_url'] = args.default_station
+
+            for key, value in settings.items():
+                kv = {key: value}
+                ser.write(json.dumps(kv).encode())
+                if not wait_for_echo(ser, kv):
+                    raise Exception(f"The radio didn't echo {key}")
+
+            # Read back what the radio stored. print_config_to_serial() names these differently from the keys sent.
+            config = read_config(ser, verbose=False)
+            expected = {'radioID': settings.get('radio_id'), 'remote_cfg_url': settings.get('remote_cfg_url'),
+                        'stn_1_url': settings.get('stn_1_url'), 'pcb_version': settings.get('pcb_version'),
+                        'remote_config_background_retrieval_interval': settings.get('remote_config_background_retrieval_interval'),
+                        'has_channel_pot': int(settings['has_channel_pot'])}
+            mismatches = [key for key, value in expected.items() if value is not None and config.get(key) != str(value)]
+            if mismatches:
+                raise Exception(f"Read back doesn't match for: {', '.join(mismatches)}")
+
+            if args.wifi:
+                write_to_serial(ser, {"ssid": "radio-setup", "pass": "supersimpleradio"})
+
+        report['config_s'] = time() - config_start
+        print(f"[{port}] Done", flush=True)
+    except Exception as e:
+        report['error'] = str(e)
+        print(f"[{port}] Failed: {e}", flush=True)
+    report['total_s'] = time() - start
+    return report
+
+def provision(ports, args):
+    if not ports:
+        print("No radios found.", flush=True)
+        return False
+
+    start = time()
+    with ThreadPoolExecutor(max_workers=args.jobs or len(ports)) as executor:
+        reports = list(executor.map(lambda port: provision_radio(port, args), ports))
+    elapsed = time() - start
+
+    def fmt(value, digits=1):
+        return '-' if value is None else f"{value:.{digits}f}"
+
+    print()
+    print(f"{'port':<16} {'mac':<18} {'radio_id':<37} {'flash_s':>8} {'flash_KB/s':>10} {'config_s':>8} {'total_s':>8}  result")
+    for r in reports:
+        result = 'ok' if r['error'] is None else f"FAILED: {r['error']}"
+        print(f"{r['port']:<16} {r['mac'] or '-':<18} {r['radio_id'] or '-':<37} {fmt(r['flash_s']):>8} {fmt(r['flash_kbps']):>10} {fmt(r['config_s']):>8} {fmt(r['total_s']):>8}  {result}")
+
+    succeeded = sum(1 for r in reports if r['error'] is None)
+    print(f"\n{succeeded}/{len(reports)} radios provisioned in {elapsed:.1f} s ({succeeded / elapsed * 60:.1f} radios/minute)")
+    return succeeded == len(reports)
 
 def load_settings_file(args):
     with open(args.file, 'r') as file:
@@ -146,12 +321,24 @@ if __name__ == '__main__':
     if args.file:
         load_settings_file(args)
 
-    ignore_ports = ['/dev/ttyS0']
+    if args.firmware_version:
+        try:
+            args.firmware_dir = find_firmware_dir(args.firmware_version, args.pcb_version)
+        except Exception as e:
+            print(e)
+            sys.exit(1)
+
+    if args.action == 'provision':
+        ports = detect_radio_ports() if args.auto_detect_serial_port else [p for p in (args.targets or [args.target]) if p]
+        print(f'Using Ports: {", ".join(ports)}')
+        sys.exit(0 if provision(ports, args) else 1)
+
     if args.auto_detect_serial_port:
-        for p in serial_ports():
-            if p not in ignore_ports:
-                port = p
-                break
+        ports = detect_radio_ports()
+        if not ports:
+            print("No radios found.")
+            sys.exit(1)
+        port = ports[0]
     else:
         port = args.target
 
@@ -159,7 +346,7 @@ if __name__ == '__main__':
 
     # THERE SHOULD ONLY BE ONE SERIAL CONNECTION SO IT DOESN'T REBOOT
     # It will reboot entering/leaving the connection.
-    with serial.Serial(port, 115200) as ser:
+    with serial.Serial(port, 115200, timeout=SERIAL_TIMEOUT_S) as ser:
 
         if args.action in ['create', 'update']:
             # This will print out the config. It should also verify the config.
@@ -176,11 +363,5 @@ if __name__ == '__main__':
 
         elif args.action == 'write_firmware':
             print('If writing over UART, be sure to press the boot to program button', flush=True)
-            esptool.main(['--chip', 'esp32s3', '--port', port, '--baud', '921600',  '--before', 
-                        'default_reset', '--after', 'hard_reset', 'write_flash',  '-z', 
-                        '--flash_mode', 'dio', '--flash_freq', '80m', '--flash_size', '4MB', 
-                        '0x0', f'./{args.firmware_version}/firmware.ino.bootloader.bin', '0x8000', 
-                        f'./{args.firmware_version}/firmware.ino.partitions.bin', '0xe000', 
-                        './libs/esp32s3-2.0.14.boot_app0.bin', '0x10000', 
-                        f'./{args.firmware_version}/firmware.ino.bin'])
+            esptool.main(esptool_write_flash_args(port, args.firmware_dir))
 
@@ -0,0 +1,3 @@
+#!/bin/bash
+# Writes a fallback clip ($1, an MP3) to the spiffs partition as a LittleFS image, see firmware/FallbackAudio.h. $2 is the port. Requires mklittlefs.
+image_dir=$(mktemp -d) && cp "$1" $image_dir/fallback.mp3 && mklittlefs -c $image_dir -p 256 -b 4096 -s 0x160000 $image_dir.bin && esptool.py --chip esp32s3 --port $2 --baud 921600 --before default_reset --after hard_reset write_flash -z --flash_mode dio --flash_freq 80m --flash_size 4MB 0x290000 $image_dir.bin
\ No newline at end of file
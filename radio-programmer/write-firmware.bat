@@ -1 +1,6 @@
-esptool.py --chip esp32s3 --port %2 --baud 921600  --before default_reset --after hard_reset write_flash  -z --flash_mode dio --flash_freq 80m --flash_size 4MB 0x0 ./%1/firmware.ino.bootloader.bin 0x8000 ./%1/firmware.ino.partitions.bin 0xe000 esp32s3-2.0.14.boot_app0.bin 0x10000 ./%1/firmware.ino.bin
\ No newline at end of file
+@echo off
+rem Usage: write-firmware.bat <firmware version> <port> [pcb version]
+rem Firmware built with board profiles (see firmware/BoardProfiles.h) has a build per PCB in .\<firmware version>\<pcb version>\.
+set dir=.\%1
+if not "%3"=="" set dir=.\%1\%3
+esptool.py --chip esp32s3 --port %2 --baud 921600  --before default_reset --after hard_reset write_flash  -z --flash_mode dio --flash_freq 80m --flash_size 4MB 0x0 %dir%/firmware.ino.bootloader.bin 0x8000 %dir%/firmware.ino.partitions.bin 0xe000 esp32s3-2.0.14.boot_app0.bin 0x10000 %dir%/firmware.ino.bin
\ No newline at end of file
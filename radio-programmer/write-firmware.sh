@@ -1,2 +1,44 @@
 #!/bin/bash
-esptool.py --chip esp32s3 --port $2 --baud 921600  --before default_reset --after hard_reset write_flash  -z --flash_mode dio --flash_freq 80m --flash_size 4MB 0x0 ./$1/firmware.ino.bootloader.bin 0x8000 ./$1/firmware.ino.partitions.bin 0xe000 esp32s3-2.0.14.boot_app0.bin 0x10000 ./$1/firmware.ino.bin
\ No newline at end of file
+# Usage: write-firmware.sh [-b <pcb version>] <firmware version> <port> [port ...]
+# With more than one port, the radios are written at the same time and each port's output is saved to write-firmware-<port>.log.
+# Firmware built with board profiles (see firmware/BoardProfiles.h) has a build per PCB in ./<firmware version>/<pcb version>/, pick it
+# with -b. Older versions have a single build in ./<firmware version>/.
+board=""
+if [ "$1" = "-b" ]; then
+  board=$2
+  shift 2
+fi
+version=$1
+shift
+
+dir=./$version
+boards=$(find "$dir" -mindepth 1 -maxdepth 1 -type d -printf '%f ' 2>/dev/null)
+if [ -n "$boards" ]; then
+  if [ -z "$board" ] || [ ! -d "$dir/$board" ]; then
+    echo "$version has a build per PCB. Pass -b with one of: $boards"
+    exit 1
+  fi
+  dir=$dir/$board
+fi
+
+if [ $# -eq 1 ]; then
+  esptool.py --chip esp32s3 --port $1 --baud 921600  --before default_reset --after hard_reset write_flash  -z --flash_mode dio --flash_freq 80m --flash_size 4MB 0x0 $dir/firmware.ino.bootloader.bin 0x8000 $dir/firmware.ino.partitions.bin 0xe000 esp32s3-2.0.14.boot_app0.bin 0x10000 $dir/firmware.ino.bin
+  exit $?
+fi
+
+declare -A pids
+for port in "$@"; do
+  esptool.py --chip esp32s3 --port $port --baud 921600  --before default_reset --after hard_reset write_flash  -z --flash_mode dio --flash_freq 80m --flash_size 4MB 0x0 $dir/firmware.ino.bootloader.bin 0x8000 $dir/firmware.ino.partitions.bin 0xe000 esp32s3-2.0.14.boot_app0.bin 0x10000 $dir/firmware.ino.bin > "write-firmware-$(basename $port).log" 2>&1 &
+  pids[$port]=$!
+done
+
+failed=0
+for port in "$@"; do
+  if wait ${pids[$port]}; then
+    echo "$port: ok"
+  else
+    echo "$port: FAILED, see write-firmware-$(basename $port).log"
+    failed=1
+  fi
+done
+exit $failed
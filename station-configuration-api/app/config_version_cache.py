@@ -0,0 +1,81 @@
+import logging
+import threading
+import time
+from database import Database
+
+# How often the versions of the radios with a long-poll open are refreshed, in one query per worker process.
+REFRESH_INTERVAL_S = 3
+
+
+class ConfigVersionCache(object):
+    """
+
+    Shared by every config_version long-poll in a worker process. A single background thread reads config_version for all the radios
+    that have a poll open, in one query per REFRESH_INTERVAL_S, and wakes the polls whose version changed. A held poll doesn't use a
+    database connection.
+
+    Under gunicorn's gevent worker, threading is monkey patched, so the thread and the waits are greenlets.
+
+    """
+
+    def __init__(self):
+        self.condition = threading.Condition()
+        self.waiters = {}  # radio_id -> number of polls waiting
+        self.versions = {}  # radio_id -> config_version, for the radios in waiters
+        self.thread = None
+
+    def wait_for_change(self, radio_id, version, known, timeout_s):
+        """
+        Waits until the radio's config_version differs from known, or timeout_s has passed. version is the version the caller just
+        read. Returns the current version.
+        """
+        deadline = time.monotonic() + timeout_s
+        with self.condition:
+            self._start()
+            self.waiters[radio_id] = self.waiters.get(radio_id, 0) + 1
+            self.versions.setdefault(radio_id, version)
+            try:
+                while True:
+                    version = self.versions[radio_id]
+                    remaining = deadline - time.monotonic()
+                    if version != known or remaining <= 0:
+                        return version
+                    self.condition.wait(remaining)
+            finally:
+                self.waiters[radio_id] -= 1
+                if self.waiters[radio_id] == 0:
+                    del self.waiters[radio_id]
+                    del self.versions[radio_id]
+
+    def _start(self):
+        # Started on first use, in the worker process, so it isn't lost when gunicorn forks.
+        if self.thread is None:
+            self.thread = threading.Thread(target=self._run, daemon=True)
+            self.thread.start()
+
+    def _run(self):
+        while True:
+            time.sleep(REFRESH_INTERVAL_S)
+            with self.condition:
+                radio_ids = list(self.waiters)
+            if not radio_ids:
+                continue
+
+            try:
+                with Database() as connection:
+                    query = f"SELECT radio_id, config_version FROM Radios WHERE radio_id IN ({', '.join(['%s'] * len(radio_ids))});"
+                    connection.execute(query, radio_ids)
+                    rows = connection.fetch()
+            except Exception:
+                # Keep the polls waiting, they time out and the radios poll again.
+                logging.exception("config_version refresh failed")
+                continue
+
+            with self.condition:
+                for row in rows:
+                    if row["radio_id"] in self.versions:
+                        self.versions[row["radio_id"]] = row["config_version"]
+                self.condition.notify_all()
+
+
+config_version_cache = ConfigVersionCache()
@@ -19,12 +19,16 @@ class Database(object):
             password=WEBSITE_DB_PASS,
             database=WEBSITE_DB_DATABASE,
             autocommit=self.autocommit,
+            # The pure Python driver's sockets are patched by gunicorn's gevent worker, so a query yields instead of blocking the worker.
+            use_pure=True,
         )
         self.cursor = self.connection.cursor()
         return self
 
     def __exit__(self, exc_type, exc_val, exc_tb):
         if self.connection:
+            if not self.autocommit and exc_type is not None:
+                self.connection.rollback()
             self.cursor.close()
             self.connection.close()
 
@@ -58,3 +62,10 @@ class Database(object):
 
     def lastrowid(self):
         return self.cursor.lastrowid
+
+    def rowcount(self):
+        return self.cursor.rowcount
+
+    def commit(self):
+        # Only needed with Database(autocommit=False). Uncommitted changes are discarded when the connection closes.
+        self.connection.commit()
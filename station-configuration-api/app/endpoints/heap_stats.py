@@ -0,0 +1,36 @@
+from flask import session
+from flask_restful import Resource, reqparse
+from endpoints import admins_only
+from database import Database
+
+
+class RadiosHeapStatsEndpoint(Resource):
+    """
+    Heap watermarks reported by radios, per radio, most fragmented first. dma_largest_min is the smallest largest free DMA block seen,
+    which is what the audio decoder needs to (re)connect. The latest history is the per window low of the last check-in, oldest first.
+    """
+
+    method_decorators = [admins_only]
+
+    def get(self):
+        parser = reqparse.RequestParser()
+        parser.add_argument("network_id", type=int, default=None)
+        parser.add_argument("days", type=int, default=7)
+        args = parser.parse_args()
+
+        with Database() as connection:
+            data = (args["days"], args["network_id"], args["network_id"], session["user_id"])
+            # Admin must be associated with the radio's network.
+            query = (
+                "SELECT Radios.radio_id, Radios.network_id, Radios.label, Radios.firmware_version, "
+                + "COUNT(*) AS reports, MIN(free_min) AS free_min, MIN(dma_largest_min) AS dma_largest_min, SUM(low_events) AS low_events, "
+                + "SUBSTRING_INDEX(GROUP_CONCAT(dma_largest_history_kb ORDER BY reported_at DESC SEPARATOR '|'), '|', 1) AS latest_dma_largest_history_kb, "
+                + "MAX(reported_at) AS last_reported_at "
+                + "FROM RadioHeapStats JOIN Radios ON RadioHeapStats.radio_id = Radios.radio_id "
+                + "WHERE reported_at > NOW() - INTERVAL %s DAY AND (Radios.network_id = %s OR %s IS NULL) "
+                + "AND Radios.network_id IN (SELECT network_id FROM AdminsNetworks WHERE user_id = %s) "
+                + "GROUP BY Radios.radio_id ORDER BY dma_largest_min ASC, low_events DESC;"
+            )
+            connection.execute(query, data)
+            stats = connection.fetch()
+        return stats
@@ -1,5 +1,67 @@
+import re
 from flask_restful import Resource, reqparse, inputs
 from database import Database
+from config_version_cache import config_version_cache
+
+# Order of the comma separated counters in each stn<N>_stats argument sent by the radio. See firmware/StreamStats.h.
+STREAM_STATS_FIELDS = ["connects", "connect_ms_total", "connect_ms_max", "underruns", "reconnects", "kbytes_received"]
+MAX_STATION_COUNT = 9
+
+# Order of the comma separated counters in the heap argument sent by the radio. See firmware/MemoryGuard.h.
+HEAP_STATS_FIELDS = ["free_min", "dma_largest_min", "low_events"]
+HEAP_HISTORY_MAX_WINDOWS = 12
+
+# Playback states in the order the radio numbers them in state_ms, state_entries and state_transitions. See firmware/RadioStateMachine.h.
+RADIO_STATES = ["idle", "connecting", "buffering", "playing", "reconnecting", "wifi_lost"]
+STATE_TRANSITIONS_PATTERN = re.compile(r"^[0-5]-[0-5]-[0-9]+(,[0-5]-[0-5]-[0-9]+)*$")
+
+# Order of the comma separated counters in the config_http argument sent by the radio. See firmware/ConfigHttpSession.h.
+CONFIG_HTTP_STATS_FIELDS = [
+    "requests",
+    "reused",
+    "stale_retries",
+    "failures",
+    "connect_ms_total",
+    "connect_ms_max",
+    "transfer_ms_total",
+    "transfer_ms_max",
+]
+
+# Long-poll for config changes. The radio's HTTP client times out after 65 seconds, so requests are held for less than that.
+LONG_POLL_MAX_TIMEOUT_S = 55
+
+
+def parse_counters(value, count):
+    if value is None:
+        return None
+    counters = value.split(",")
+    if len(counters) != count:
+        return None
+    try:
+        return [int(c) for c in counters]
+    except ValueError:
+        return None
+
+
+def parse_stream_stats(value):
+    return parse_counters(value, len(STREAM_STATS_FIELDS))
+
+
+def parse_heap_history(value):
+    # Smallest largest-DMA-block in KB per 5 minute window, oldest first. Stored as sent, once validated.
+    if not value:
+        return None
+    windows = value.split(",")
+    if len(windows) > HEAP_HISTORY_MAX_WINDOWS or not all(w.isdigit() for w in windows):
+        return None
+    return ",".join(windows)
+
+
+def parse_state_transitions(value):
+    # <from>-<to>-<count>, for the transitions taken since the radio's last check-in. Stored as sent, once validated.
+    if not value or len(value) > 255 or not STATE_TRANSITIONS_PATTERN.match(value):
+        return None
+    return value
 
 
 class RadioDeviceInterface_v1_0_Endpoint(Resource):
@@ -10,6 +72,17 @@ class RadioDeviceInterface_v1_0_Endpoint(Resource):
         parser.add_argument("max_station_count", type=int)
         parser.add_argument("has_channel_potentiometer", type=inputs.boolean)
         parser.add_argument("update_last_seen", type=inputs.boolean, default=True)
+        for i in range(1, MAX_STATION_COUNT + 1):
+            parser.add_argument("stn" + str(i) + "_stats", type=str)
+        parser.add_argument("wifi_reconnects", type=int)
+        parser.add_argument("wifi_reconnect_ms_total", type=int, default=0)
+        parser.add_argument("wifi_reconnect_ms_max", type=int, default=0)
+        parser.add_argument("heap", type=str)
+        parser.add_argument("heap_history", type=str)
+        parser.add_argument("state_ms", type=str)
+        parser.add_argument("state_entries", type=str)
+        parser.add_argument("state_transitions", type=str)
+        parser.add_argument("config_http", type=str)
         args = parser.parse_args()
 
         with Database() as connection:
@@ -28,8 +101,14 @@ class RadioDeviceInterface_v1_0_Endpoint(Resource):
             )
             connection.execute(query, data)
 
+            # WiFi reconnect times since the radio's last check-in.
+            if args["wifi_reconnects"]:
+                data = (args["wifi_reconnects"], args["wifi_reconnect_ms_total"], args["wifi_reconnect_ms_max"], radio_id)
+                query = "UPDATE Radios SET wifi_reconnects=wifi_reconnects+%s, wifi_reconnect_ms_total=wifi_reconnect_ms_total+%s, wifi_reconnect_ms_max=GREATEST(wifi_reconnect_ms_max, %s) WHERE radio_id=%s;"
+                connection.execute(query, data)
+
             data = (radio_id,)
-            query = "SELECT station_url FROM RadiosStations JOIN Stations ON RadiosStations.station_id = Stations.station_id WHERE radio_id = %s ORDER BY position ASC;"
+            query = "SELECT Stations.station_id, station_url FROM RadiosStations JOIN Stations ON RadiosStations.station_id = Stations.station_id WHERE radio_id = %s ORDER BY position ASC;"
             connection.execute(query, data)
             stations = connection.fetch()
 
@@ -38,12 +117,97 @@ class RadioDeviceInterface_v1_0_Endpoint(Resource):
             connection.execute(query, data)
             radio = connection.fetch(first=True)
 
+            # Stream stats are reported by station position, which is resolved to the station currently in that position.
+            data = []
+            for position, station in enumerate(stations):
+                counters = parse_stream_stats(args["stn" + str(position + 1) + "_stats"])
+                if counters is not None:
+                    data.append((radio_id, station["station_id"], radio["network_id"], *counters))
+            if data:
+                query = (
+                    "INSERT INTO StationStreamStats (radio_id, station_id, network_id, "
+                    + ", ".join(STREAM_STATS_FIELDS)
+                    + ", reported_at) VALUES (%s, %s, %s, %s, %s, %s, %s, %s, %s, NOW());"
+                )
+                connection.executemany(query, data)
+
+            # Heap watermarks since the radio's last check-in.
+            heap = parse_counters(args["heap"], len(HEAP_STATS_FIELDS))
+            if heap is not None:
+                data = (radio_id, radio["network_id"], *heap, parse_heap_history(args["heap_history"]))
+                query = (
+                    "INSERT INTO RadioHeapStats (radio_id, network_id, "
+                    + ", ".join(HEAP_STATS_FIELDS)
+                    + ", dma_largest_history_kb, reported_at) VALUES (%s, %s, %s, %s, %s, %s, NOW());"
+                )
+                connection.execute(query, data)
+
+            # Time in each playback state and the transitions taken since the radio's last check-in.
+            state_ms = parse_counters(args["state_ms"], len(RADIO_STATES))
+            state_entries = parse_counters(args["state_entries"], len(RADIO_STATES))
+            if state_ms is not None and state_entries is not None:
+                data = (radio_id, radio["network_id"], *state_ms, *state_entries, parse_state_transitions(args["state_transitions"]))
+                columns = [state + "_ms" for state in RADIO_STATES] + [state + "_entries" for state in RADIO_STATES]
+                query = (
+                    "INSERT INTO RadioStateStats (radio_id, network_id, "
+                    + ", ".join(columns)
+                    + ", transitions, reported_at) VALUES ("
+                    + ", ".join(["%s"] * len(data))
+                    + ", NOW());"
+                )
+                connection.execute(query, data)
+
+            # Config request connect and transfer times since the radio's last check-in.
+            config_http = parse_counters(args["config_http"], len(CONFIG_HTTP_STATS_FIELDS))
+            if config_http is not None:
+                data = (radio_id, radio["network_id"], *config_http)
+                query = (
+                    "INSERT INTO RadioConfigHttpStats (radio_id, network_id, "
+                    + ", ".join(CONFIG_HTTP_STATS_FIELDS)
+                    + ", reported_at) VALUES ("
+                    + ", ".join(["%s"] * len(data))
+                    + ", NOW());"
+                )
+                connection.execute(query, data)
+
         station_urls = [s["station_url"] for s in stations]
 
-        response = {"stationCount": len(station_urls)}
+        response = {"stationCount": len(station_urls), "configVersion": radio["config_version"]}
 
-        stationsKeys = [ "stn" + str(i) + "URL" for i in range(1,10) ]
+        stationsKeys = [ "stn" + str(i) + "URL" for i in range(1, MAX_STATION_COUNT + 1) ]
         for i, key in enumerate(stationsKeys[0:radio["max_station_count"]]):
             response[key] = station_urls[i] if i < len(station_urls) else ""
 
         return response
+
+
+class RadioDeviceInterfaceConfigVersion_v1_0_Endpoint(Resource):
+    """
+    Long-poll used by radios to learn about config changes within seconds.
+
+    The request is held until the radio's config_version differs from the version the radio already has (known), or until timeout_s
+    has passed. Either way the current version is returned, and the radio only downloads its full config when it has changed.
+
+    Held polls wait on the process wide ConfigVersionCache, so they don't hold a database connection or query on their own.
+    """
+
+    def get(self, radio_id):
+        parser = reqparse.RequestParser()
+        parser.add_argument("known", type=int, required=True)
+        parser.add_argument("timeout_s", type=int, default=LONG_POLL_MAX_TIMEOUT_S)
+        args = parser.parse_args()
+
+        # A connection is only held for this query, not for the wait.
+        with Database() as connection:
+            data = (radio_id,)
+            connection.execute("SELECT config_version FROM Radios WHERE radio_id = %s;", data)
+            radio = connection.fetch(first=True)
+
+        if radio is None:
+            return "Radio Not Found", 404
+
+        timeout_s = max(0, min(args["timeout_s"], LONG_POLL_MAX_TIMEOUT_S))
+        version = radio["config_version"]
+        if version == args["known"] and timeout_s > 0:
+            version = config_version_cache.wait_for_change(radio_id, version, args["known"], timeout_s)
+        return {"configVersion": version}
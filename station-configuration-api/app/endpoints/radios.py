@@ -1,10 +1,80 @@
-from flask import session
+from flask import request, session
 from flask_restful import Resource, reqparse, inputs
 from mysql.connector.errors import IntegrityError
 from endpoints import admins_only, is_admin
 from database import Database
 from flask_exception import CustomFlaskException
 
+get_radio_query = "SELECT * FROM Radios WHERE radio_id = %s LIMIT 1;"
+get_radio_stations_query = "SELECT Stations.station_id, network_id, station_url, station_name, position FROM RadiosStations JOIN Stations ON RadiosStations.station_id = Stations.station_id WHERE radio_id = %s ORDER BY position ASC;"
+
+
+def placeholders(values):
+    return ", ".join(["%s"] * len(values))
+
+
+def station_lineup_arg(args):
+    """
+    Returns the station_id list from args, or None if it wasn't sent. reqparse returns the default for an empty list, so an empty
+    lineup (which clears the radio's stations) is told apart from a missing one by the JSON body.
+    """
+    if args["station_id"] is not None:
+        return args["station_id"]
+    body = request.get_json(silent=True)
+    if isinstance(body, dict) and body.get("station_id") == []:
+        return []
+    return None
+
+
+def fetch_radio(connection, radio_id):
+    connection.execute(get_radio_query, (radio_id,))
+    radio = connection.fetch(first=True)
+    if radio is not None:
+        connection.execute(get_radio_stations_query, (radio_id,))
+        radio["stations"] = connection.fetch()
+    return radio
+
+
+def apply_station_lineup(connection, radio_ids, station_ids):
+    """
+
+    Makes the stations of every radio in radio_ids match station_ids (in position order). Only the rows that differ are deleted or
+    inserted, and config_version is bumped in a single UPDATE for the radios that changed, which wakes their long-polls.
+
+    Returns the radio_ids that changed. Runs on the caller's connection, so it is part of the caller's transaction.
+
+    """
+    if not radio_ids:
+        return []
+
+    desired = set(enumerate(station_ids))
+
+    connection.execute(
+        f"SELECT radio_id, station_id, position FROM RadiosStations WHERE radio_id IN ({placeholders(radio_ids)});", radio_ids
+    )
+    current = {radio_id: set() for radio_id in radio_ids}
+    for row in connection.fetch():
+        current[row["radio_id"]].add((row["position"], row["station_id"]))
+
+    stale_rows = [(radio_id, station_id, position) for radio_id in radio_ids for position, station_id in current[radio_id] - desired]
+    new_rows = [(radio_id, station_id, position) for radio_id in radio_ids for position, station_id in desired - current[radio_id]]
+    changed_radio_ids = sorted({row[0] for row in stale_rows + new_rows})
+
+    if stale_rows:
+        query = (
+            f"DELETE FROM RadiosStations WHERE (radio_id, station_id, position) IN ({', '.join(['(%s, %s, %s)'] * len(stale_rows))});"
+        )
+        connection.execute(query, [value for row in stale_rows for value in row])
+    if new_rows:
+        connection.executemany("INSERT INTO RadiosStations (radio_id, station_id, position) VALUES (%s, %s, %s)", new_rows)
+    if changed_radio_ids:
+        connection.execute(
+            f"UPDATE Radios SET config_version=config_version+1 WHERE radio_id IN ({placeholders(changed_radio_ids)});",
+            changed_radio_ids,
+        )
+
+    return changed_radio_ids
+
 
 class RadiosEndpoint(Resource):
     method_decorators = [admins_only]
@@ -65,20 +135,10 @@ class RadioEndpoint(Resource):
 
     def get(self, radio_id):
         with Database() as connection:
-            # Get Radio
-            data = (radio_id,)
-            query = "SELECT * FROM Radios WHERE radio_id = %s LIMIT 1;"
-            connection.execute(query, data)
-            result = connection.fetch(first=True)
-
-            if result is None:
-                return "Radio Not Found", 404
+            result = fetch_radio(connection, radio_id)
 
-            # Get Stations
-            data = (radio_id,)
-            query = "SELECT Stations.station_id, network_id, station_url, station_name, position FROM RadiosStations JOIN Stations ON RadiosStations.station_id = Stations.station_id WHERE radio_id = %s ORDER BY position ASC;"
-            connection.execute(query, data)
-            result["stations"] = connection.fetch()
+        if result is None:
+            return "Radio Not Found", 404
 
         return result
 
@@ -87,35 +147,81 @@ class RadioEndpoint(Resource):
         parser.add_argument("label", type=str)
         parser.add_argument("network_id", type=int)
         parser.add_argument("show_stations_from_all_networks", type=inputs.boolean, default=False)
-        parser.add_argument("station_id", action="append", type=str)
+        parser.add_argument("station_id", action="append", type=int)
         args = parser.parse_args()
+        station_ids = station_lineup_arg(args)
 
-        radio = self.get(radio_id)
+        # One connection and one transaction for the read, the writes and the response.
+        with Database(autocommit=False) as connection:
+            radio = fetch_radio(connection, radio_id)
+            if radio is None:
+                return "Radio Not Found", 404
 
-        radio["label"] = args["label"]
-        if is_admin(session):
-            radio["network_id"] = args["network_id"]
-            radio["show_stations_from_all_networks"] = args["show_stations_from_all_networks"]
+            # The web interface doesn't send the label, so keep it unless one is given.
+            if args["label"] is not None:
+                radio["label"] = args["label"]
+            if is_admin(session):
+                radio["network_id"] = args["network_id"]
+                radio["show_stations_from_all_networks"] = args["show_stations_from_all_networks"]
 
-        with Database() as connection:
-            # Update the Radios table
+            # None of these are sent to the radio, so config_version is left alone. apply_station_lineup() bumps it if the lineup changes.
             data = (radio["label"], radio["network_id"], radio["show_stations_from_all_networks"], radio_id)
             query = "UPDATE Radios SET label=%s, network_id=%s, show_stations_from_all_networks=%s WHERE radio_id=%s;"
             connection.execute(query, data)
 
-            # delete all stations associated with the radio_id
-            data = (radio_id,)
-            query = "DELETE FROM RadiosStations WHERE radio_id=%s;"
-            connection.execute(query, data)
+            if station_ids is not None:
+                apply_station_lineup(connection, [radio_id], station_ids)
 
-            # Insert stations
-            data = []
-            for position, station_id in enumerate(args["station_id"]):
-                data.append((radio_id, station_id, position))
-            query = "INSERT INTO RadiosStations (radio_id, station_id, position) VALUES (%s, %s, %s)"
-            connection.executemany(query, data)
+            connection.commit()
+            radio = fetch_radio(connection, radio_id)
 
-        return self.get(radio_id)
+        return radio
 
     # def delete(self, radio_id):
     #     pass
+
+
+class RadiosStationsEndpoint(Resource):
+    """
+    Applies one station lineup to many radios at once: the radios listed in radio_id, every radio in network_id, or both.
+    """
+
+    method_decorators = [admins_only]
+
+    def put(self):
+        parser = reqparse.RequestParser()
+        parser.add_argument("radio_id", action="append", type=str, default=[])
+        parser.add_argument("network_id", type=int, default=None)
+        parser.add_argument("station_id", action="append", type=int)
+        args = parser.parse_args()
+        station_ids = station_lineup_arg(args)
+        if station_ids is None:
+            raise CustomFlaskException("station_id is required, send an empty list to clear the radios' stations.", status_code=400)
+
+        if not args["radio_id"] and args["network_id"] is None:
+            raise CustomFlaskException("Either radio_id or network_id is required.", status_code=400)
+
+        with Database(autocommit=False) as connection:
+            # Admin must be associated with the radios' networks. The rows are locked until the commit, so concurrent edits don't interleave.
+            data = args["radio_id"] + [args["network_id"], session["user_id"]]
+            radio_id_filter = f"radio_id IN ({placeholders(args['radio_id'])}) OR " if args["radio_id"] else ""
+            query = f"SELECT radio_id FROM Radios WHERE ({radio_id_filter}network_id = %s) AND network_id IN (SELECT network_id FROM AdminsNetworks WHERE user_id = %s) FOR UPDATE;"
+            connection.execute(query, data)
+            radio_ids = [row["radio_id"] for row in connection.fetch()]
+
+            if not radio_ids:
+                return "No Radios Found", 404
+
+            # Admin must be associated with the stations' networks.
+            unique_station_ids = set(station_ids)
+            if unique_station_ids:
+                data = list(unique_station_ids) + [session["user_id"]]
+                query = f"SELECT station_id FROM Stations WHERE station_id IN ({placeholders(unique_station_ids)}) AND network_id IN (SELECT network_id FROM AdminsNetworks WHERE user_id = %s);"
+                connection.execute(query, data)
+                if len(connection.fetch()) != len(unique_station_ids):
+                    raise CustomFlaskException("One or more stations were not found.", status_code=400)
+
+            changed_radio_ids = apply_station_lineup(connection, radio_ids, station_ids)
+            connection.commit()
+
+        return {"radios_matched": len(radio_ids), "radios_changed": len(changed_radio_ids), "changed_radio_ids": changed_radio_ids}
@@ -0,0 +1,39 @@
+from flask import session
+from flask_restful import Resource, reqparse
+from endpoints import admins_only
+from database import Database
+
+
+class RadiosStateStatsEndpoint(Resource):
+    """
+    Time radios spent in each playback state, per radio, most time reconnecting or without WiFi first. The latest transitions are
+    those of the last check-in, as <from>-<to>-<count> with states numbered as in RadioStateStats.
+    """
+
+    method_decorators = [admins_only]
+
+    def get(self):
+        parser = reqparse.RequestParser()
+        parser.add_argument("network_id", type=int, default=None)
+        parser.add_argument("days", type=int, default=7)
+        args = parser.parse_args()
+
+        with Database() as connection:
+            data = (args["days"], args["network_id"], args["network_id"], session["user_id"])
+            # Admin must be associated with the radio's network.
+            query = (
+                "SELECT Radios.radio_id, Radios.network_id, Radios.label, Radios.firmware_version, COUNT(*) AS reports, "
+                + "SUM(idle_ms) AS idle_ms, SUM(connecting_ms) AS connecting_ms, SUM(buffering_ms) AS buffering_ms, "
+                + "SUM(playing_ms) AS playing_ms, SUM(reconnecting_ms) AS reconnecting_ms, SUM(wifi_lost_ms) AS wifi_lost_ms, "
+                + "SUM(buffering_entries) AS buffering_entries, SUM(reconnecting_entries) AS reconnecting_entries, "
+                + "SUM(wifi_lost_entries) AS wifi_lost_entries, "
+                + "SUBSTRING_INDEX(GROUP_CONCAT(transitions ORDER BY reported_at DESC SEPARATOR '|'), '|', 1) AS latest_transitions, "
+                + "MAX(reported_at) AS last_reported_at "
+                + "FROM RadioStateStats JOIN Radios ON RadioStateStats.radio_id = Radios.radio_id "
+                + "WHERE reported_at > NOW() - INTERVAL %s DAY AND (Radios.network_id = %s OR %s IS NULL) "
+                + "AND Radios.network_id IN (SELECT network_id FROM AdminsNetworks WHERE user_id = %s) "
+                + "GROUP BY Radios.radio_id ORDER BY reconnecting_ms + wifi_lost_ms DESC;"
+            )
+            connection.execute(query, data)
+            stats = connection.fetch()
+        return stats
@@ -6,6 +6,9 @@ from database import Database
 # Admin must be associated with the station's network.
 get_station_query = "SELECT * FROM Stations WHERE network_id = %s AND station_id = %s AND EXISTS (SELECT * FROM AdminsNetworks WHERE network_id = %s AND user_id = %s) LIMIT 1;"
 
+# Wakes the long-poll of every radio that has the station, so they download the new config.
+bump_radios_config_version_query = "UPDATE Radios SET config_version=config_version+1 WHERE radio_id IN (SELECT radio_id FROM RadiosStations WHERE station_id = %s);"
+
 
 class StationsEndpoint(Resource):
     method_decorators = {"post": [admins_only]}
@@ -63,10 +66,16 @@ class StationEndpoint(Resource):
         parser.add_argument("station_name", type=str)
         args = parser.parse_args()
         with Database() as connection:
+            connection.execute("SELECT station_url FROM Stations WHERE station_id = %s;", (station_id,))
+            current = connection.fetch(first=True)
+
             data = (args["station_url"], args["station_name"], station_id, session["user_id"], network_id)
             # Admin must be associated with the station's network.
             query = "UPDATE Stations SET station_url = %s, station_name = %s WHERE station_id = %s AND EXISTS (SELECT * FROM AdminsNetworks WHERE user_id = %s AND network_id = %s) LIMIT 1;"
             connection.execute(query, data)
+            # Radios are only sent the URL, so a name-only edit doesn't wake them.
+            if connection.rowcount() > 0 and current is not None and current["station_url"] != args["station_url"]:
+                connection.execute(bump_radios_config_version_query, (station_id,))
 
             data = (network_id, station_id, network_id, session["user_id"])
             connection.execute(get_station_query, data)
@@ -76,6 +85,10 @@ class StationEndpoint(Resource):
     def delete(self, network_id, station_id):
         with Database() as connection:
             data = (station_id, session["user_id"], network_id)
+            connection.execute("SELECT * FROM AdminsNetworks WHERE user_id = %s AND network_id = %s;", data[1:])
+            if connection.fetch(first=True):
+                connection.execute(bump_radios_config_version_query, (station_id,))
+
             # Admin must be associated with the station's network.
             query = "DELETE FROM Stations WHERE station_id = %s AND EXISTS (SELECT * FROM AdminsNetworks WHERE user_id = %s AND network_id = %s)"
             connection.execute(query, data)
@@ -0,0 +1,73 @@
+from flask import session
+from flask_restful import Resource, reqparse
+from endpoints import admins_only
+from database import Database
+
+# Aggregates shared by the per-station and per-network tables. avg_connect_ms is the mean time from connecting to audio playing.
+stream_stats_columns = """
+    COUNT(DISTINCT StationStreamStats.radio_id) AS radios_reporting,
+    SUM(connects) AS connects,
+    SUM(connect_ms_total) / NULLIF(SUM(connects), 0) AS avg_connect_ms,
+    MAX(connect_ms_max) AS max_connect_ms,
+    SUM(underruns) AS underruns,
+    SUM(reconnects) AS reconnects,
+    SUM(kbytes_received) AS kbytes_received,
+    SUM(reconnects) / NULLIF(SUM(connects), 0) AS reconnects_per_connect,
+    MAX(reported_at) AS last_reported_at
+"""
+
+
+class StationsStreamStatsEndpoint(Resource):
+    """
+    Stream quality reported by radios, aggregated per station, worst first.
+    """
+
+    method_decorators = [admins_only]
+
+    def get(self):
+        parser = reqparse.RequestParser()
+        parser.add_argument("network_id", type=int, default=None)
+        parser.add_argument("days", type=int, default=7)
+        args = parser.parse_args()
+
+        with Database() as connection:
+            data = (args["days"], args["network_id"], args["network_id"], session["user_id"])
+            # Admin must be associated with the station's network.
+            query = (
+                "SELECT Stations.station_id, Stations.network_id, station_name, station_url, "
+                + stream_stats_columns
+                + "FROM StationStreamStats JOIN Stations ON StationStreamStats.station_id = Stations.station_id "
+                + "WHERE reported_at > NOW() - INTERVAL %s DAY AND (Stations.network_id = %s OR %s IS NULL) "
+                + "AND Stations.network_id IN (SELECT network_id FROM AdminsNetworks WHERE user_id = %s) "
+                + "GROUP BY Stations.station_id ORDER BY reconnects_per_connect DESC, avg_connect_ms DESC;"
+            )
+            connection.execute(query, data)
+            stats = connection.fetch()
+        return stats
+
+
+class NetworksStreamStatsEndpoint(Resource):
+    """
+    Stream quality reported by radios, aggregated per network the radios belong to, worst first.
+    """
+
+    method_decorators = [admins_only]
+
+    def get(self):
+        parser = reqparse.RequestParser()
+        parser.add_argument("days", type=int, default=7)
+        args = parser.parse_args()
+
+        with Database() as connection:
+            data = (args["days"], session["user_id"])
+            query = (
+                "SELECT Networks.network_id, "
+                + stream_stats_columns
+                + "FROM StationStreamStats JOIN Networks ON StationStreamStats.network_id = Networks.network_id "
+                + "WHERE reported_at > NOW() - INTERVAL %s DAY "
+                + "AND Networks.network_id IN (SELECT network_id FROM AdminsNetworks WHERE user_id = %s) "
+                + "GROUP BY Networks.network_id ORDER BY reconnects_per_connect DESC, avg_connect_ms DESC;"
+            )
+            connection.execute(query, data)
+            stats = connection.fetch()
+        return stats
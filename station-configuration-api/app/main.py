@@ -5,12 +5,15 @@ import datetime
 from flask_cors import CORS
 
 
-from endpoints.radios import RadioEndpoint, RadiosEndpoint
-from endpoints.radio_device_interface_v1_0 import RadioDeviceInterface_v1_0_Endpoint
+from endpoints.radios import RadioEndpoint, RadiosEndpoint, RadiosStationsEndpoint
+from endpoints.radio_device_interface_v1_0 import RadioDeviceInterface_v1_0_Endpoint, RadioDeviceInterfaceConfigVersion_v1_0_Endpoint
 from endpoints.sessions import AdminSessionsEndpoint
 from endpoints.admins import AdminsEndpoint
 from endpoints.stations import StationEndpoint, StationsEndpoint
 from endpoints.networks import NetworksEndpoint
+from endpoints.stream_stats import StationsStreamStatsEndpoint, NetworksStreamStatsEndpoint
+from endpoints.heap_stats import RadiosHeapStatsEndpoint
+from endpoints.state_stats import RadiosStateStatsEndpoint
 
 
 app = Flask(__name__)
@@ -35,17 +38,23 @@ api.add_resource(AdminsEndpoint, api_prefix + "/admins")
 api.add_resource(AdminSessionsEndpoint, api_prefix + "/admins/sessions")
 
 api.add_resource(NetworksEndpoint, api_prefix + "/networks")
+api.add_resource(NetworksStreamStatsEndpoint, api_prefix + "/networks/stats")
 # api.add_resource(NetworksEndpoint, api_prefix+'/networks/<int:network_id>')
 api.add_resource(StationsEndpoint, api_prefix + "/networks/stations")
+api.add_resource(StationsStreamStatsEndpoint, api_prefix + "/networks/stations/stats")
 api.add_resource(StationEndpoint, api_prefix + "/networks/<int:network_id>/stations/<int:station_id>")
 
 api.add_resource(RadiosEndpoint, api_prefix + "/radios")
+api.add_resource(RadiosStationsEndpoint, api_prefix + "/radios/stations")
+api.add_resource(RadiosHeapStatsEndpoint, api_prefix + "/radios/heap_stats")
+api.add_resource(RadiosStateStatsEndpoint, api_prefix + "/radios/state_stats")
 
 # CRUD for radio config using the web interface
 api.add_resource(RadioEndpoint, api_prefix + "/radios/<radio_id>")
 
 # CRUD radio config interface for the radio. Allow this to be versioned since it
 api.add_resource(RadioDeviceInterface_v1_0_Endpoint, api_prefix + "/radios/device_interface/v1.0/<radio_id>")
+api.add_resource(RadioDeviceInterfaceConfigVersion_v1_0_Endpoint, api_prefix + "/radios/device_interface/v1.0/<radio_id>/config_version")
 
 if __name__ == "__main__":
     app.run(host="0.0.0.0", debug=True)
@@ -12,6 +12,7 @@ const api = {
   },
   station: ({ stationId }) => `${apiPrefix}/networks/stations/${stationId}`,
   radios: `${apiPrefix}/radios`,
+  radiosStations: `${apiPrefix}/radios/stations`,
   radio: ({ radioId }) => `${apiPrefix}/radios/${radioId}`,
   radioDeviceInterfaceV1_0: ({ radioId }) => `${apiPrefix}/radios/device_interface/v1.0/${radioId}`
 }
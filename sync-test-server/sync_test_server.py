@@ -0,0 +1,189 @@
+# Stand-in time and stream server for testing multi-room sync (firmware/PlaybackSync.h) on a LAN.
+#
+# Runs three things:
+#   - An HTTP MP3 stream at /stream. A single producer plays the file in real time and every client gets the same live position,
+#     like an Icecast mount.
+#   - An SNTP server, so all radios share this machine's clock.
+#   - A beacon monitor, which listens to the radios' sync beacons and prints the skew (largest - smallest playout delay) per station.
+#
+# Examples:
+#
+# Stream test.mp3 at 128 kbps on port 8000 and serve time on port 123 (binding port 123 usually needs root).
+# sudo python sync_test_server.py --mp3 test.mp3 --bitrate 128
+#
+# Then configure the radios over serial:
+# {"stn_1_url": "http://<this machine>:8000/stream"}
+# {"sync_mode": true, "sync_time_server": "<this machine>"}
+
+import argparse
+import json
+import queue
+import socket
+import struct
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+SYNC_MULTICAST_IP = "239.255.73.73"
+SYNC_PORT = 7373
+SYNC_PEER_TIMEOUT_S = 3
+NTP_EPOCH_OFFSET = 2208988800  # Seconds from 1900 (NTP) to 1970 (Unix)
+CHUNK_INTERVAL_S = 0.1
+
+parser = argparse.ArgumentParser(description="Stand-in time and stream server for testing multi-room sync.")
+parser.add_argument("--mp3", required=True, help="MP3 file to stream. It is looped.")
+parser.add_argument("--bitrate", type=int, default=128, help="Bitrate of the MP3 file in kbps. Default: 128")
+parser.add_argument("--http-port", type=int, default=8000, help="Port of the stream. Default: 8000")
+parser.add_argument("--ntp-port", type=int, default=123, help="Port of the SNTP server. Radios always use 123. Default: 123")
+parser.add_argument("--burst-kb", type=int, default=0, help="Data sent to a new client right away, like Icecast's burst-on-connect. Default: 0")
+parser.add_argument("--report-s", type=float, default=2, help="Seconds between skew reports. Default: 2")
+
+
+class LiveStream:
+    """
+    Plays a file in real time and hands every chunk to all subscribers, so all clients are at the same live position.
+    """
+
+    def __init__(self, path, bitrate_kbps, burst_kb):
+        with open(path, "rb") as file:
+            self.data = file.read()
+        self.chunk_size = int(bitrate_kbps * 1000 / 8 * CHUNK_INTERVAL_S)
+        self.burst_size = burst_kb * 1024
+        self.recent = b""
+        self.subscribers = set()
+        self.lock = threading.Lock()
+
+    def subscribe(self):
+        q = queue.Queue(maxsize=100)
+        with self.lock:
+            if self.recent:
+                q.put(self.recent)
+            self.subscribers.add(q)
+        return q
+
+    def unsubscribe(self, q):
+        with self.lock:
+            self.subscribers.discard(q)
+
+    def run(self):
+        position = 0
+        next_chunk = time.monotonic()
+        while True:
+            chunk = self.data[position : position + self.chunk_size]
+            position += self.chunk_size
+            if position >= len(self.data):
+                position = 0
+            with self.lock:
+                if self.burst_size:
+                    self.recent = (self.recent + chunk)[-self.burst_size :]
+                for q in self.subscribers:
+                    try:
+                        q.put_nowait(chunk)
+                    except queue.Full:
+                        pass  # A client that can't keep up skips data, as it would on a real server.
+            next_chunk += CHUNK_INTERVAL_S
+            time.sleep(max(0, next_chunk - time.monotonic()))
+
+
+def make_stream_handler(live_stream, bitrate_kbps):
+    class StreamHandler(BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.0"
+
+        def do_GET(self):
+            if self.path != "/stream":
+                self.send_error(404)
+                return
+            self.send_response(200)
+            self.send_header("Content-Type", "audio/mpeg")
+            self.send_header("icy-br", str(bitrate_kbps))
+            self.send_header("icy-name", "sync-test-server")
+            self.end_headers()
+            q = live_stream.subscribe()
+            print(f"Stream: {self.client_address[0]} connected", flush=True)
+            try:
+                while True:
+                    self.wfile.write(q.get())
+            except (BrokenPipeError, ConnectionResetError):
+                pass
+            finally:
+                live_stream.unsubscribe(q)
+                print(f"Stream: {self.client_address[0]} disconnected", flush=True)
+
+        def log_message(self, format, *args):
+            pass
+
+    return StreamHandler
+
+
+def ntp_timestamp(t):
+    seconds = int(t) + NTP_EPOCH_OFFSET
+    fraction = int((t % 1) * 2**32)
+    return struct.pack("!II", seconds, fraction)
+
+
+def run_ntp_server(port):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", port))
+    print(f"SNTP: listening on {port}", flush=True)
+    while True:
+        request, address = sock.recvfrom(512)
+        received = time.time()
+        if len(request) < 48:
+            continue
+        # LI=0, VN=4, Mode=4 (server), stratum 1, poll, precision, root delay, root dispersion, reference id "LOCL"
+        header = struct.pack("!BBbbII4s", (0 << 6) | (4 << 3) | 4, 1, request[2], -20, 0, 0, b"LOCL")
+        originate = request[40:48]  # The client's transmit timestamp
+        response = header + ntp_timestamp(received) + originate + ntp_timestamp(received) + ntp_timestamp(time.time())
+        sock.sendto(response, address)
+
+
+def run_beacon_monitor(report_s):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", SYNC_PORT))
+    membership = struct.pack("4sl", socket.inet_aton(SYNC_MULTICAST_IP), socket.INADDR_ANY)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, membership)
+    sock.settimeout(0.2)
+    print(f"Beacons: listening on {SYNC_MULTICAST_IP}:{SYNC_PORT}", flush=True)
+
+    radios = {}
+    max_skew = {}
+    next_report = time.monotonic() + report_s
+    while True:
+        try:
+            packet, address = sock.recvfrom(512)
+            beacon = json.loads(packet)
+            radios[beacon["r"]] = {"station": beacon["k"], "sent_at": beacon["t"] / 1000, "delay_ms": beacon["d"], "ip": address[0]}
+        except socket.timeout:
+            pass
+        except (ValueError, KeyError):
+            continue
+
+        if time.monotonic() < next_report:
+            continue
+        next_report += report_s
+
+        now = time.time()
+        stations = {}
+        for radio_id, radio in radios.items():
+            if now - radio["sent_at"] < SYNC_PEER_TIMEOUT_S:
+                stations.setdefault(radio["station"], []).append((radio_id, radio))
+        for station, members in stations.items():
+            delays = [r["delay_ms"] for _, r in members]
+            skew = max(delays) - min(delays)
+            max_skew[station] = max(max_skew.get(station, 0), skew)
+            summary = ", ".join(f"{r['ip']}={r['delay_ms']}ms (clock {1000 * (now - r['sent_at']):+.0f}ms)" for _, r in members)
+            print(f"Station {station}: radios={len(members)} skew_ms={skew} max_skew_ms={max_skew[station]} | {summary}", flush=True)
+
+
+if __name__ == "__main__":
+    args = parser.parse_args()
+
+    live_stream = LiveStream(args.mp3, args.bitrate, args.burst_kb)
+    threading.Thread(target=live_stream.run, daemon=True).start()
+    threading.Thread(target=run_ntp_server, args=(args.ntp_port,), daemon=True).start()
+    threading.Thread(target=run_beacon_monitor, args=(args.report_s,), daemon=True).start()
+
+    server = ThreadingHTTPServer(("", args.http_port), make_stream_handler(live_stream, args.bitrate))
+    print(f"Stream: http://<this machine>:{args.http_port}/stream", flush=True)
+    server.serve_forever()